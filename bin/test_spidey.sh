@@ -37,7 +37,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -88,11 +88,11 @@ echo
 cowsay -W 72 <<EOF
 On another machine, please run:
 
-    valgrind --leak-check=full ./bin/spidey -r ~pbui/pub/www -p PORT -c MODE
+    valgrind --leak-check=full ./bin/spidey -r ~pbui/pub/www -p PORT -c MODE -W /scripts/hello.py=2
 
 - Where PORT is a number between 9000 - 9999
 
-- Where MODE is either single or forking
+- Where MODE is either single, forking, event, prefork, or threaded
 EOF
 echo
 
@@ -115,7 +115,7 @@ printf "\n %-64s ... \n" "Handle Browse Requests"
 
 printf "     %-60s ... " "/"
 HREFS="/..,/html,/images,/scripts,/song.txt,/text"
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/ > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. html scripts text" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
@@ -149,7 +149,7 @@ fi
 sleep 1
 
 printf "     %-60s ... " "/scripts"
-HREFS="/scripts/..,/scripts/cowsay.sh,/scripts/env.sh,/scripts/hello.py"
+HREFS="/scripts/..,/scripts/count.sh,/scripts/cowsay.sh,/scripts/echo.sh,/scripts/env.sh,/scripts/hello.py"
 curl -s -D $WORKSPACE/header $HOST:$PORT/scripts > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. cowsay.sh env.sh" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
     error "Failure"
@@ -160,7 +160,7 @@ fi
 sleep 1
 
 printf "     %-60s ... " "/text"
-HREFS="/text/..,/text/hackers.txt,/text/lyrics.txt,/text/pass"
+HREFS="/text/..,/text/hackers.txt,/text/hackers.txt.br,/text/lyrics.txt,/text/pass"
 curl -s -D $WORKSPACE/header $HOST:$PORT/text > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. hackers.txt lyrics.txt" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
     error "Failure"
@@ -183,7 +183,7 @@ printf "\n %-64s ... \n" "Handle File Requests"
 
 printf "     %-60s ... " "/html/index.html"
 MD5SUM=36fcc1da4afe58242350ee3940bb4220
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "Spidey html thumbnail" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
@@ -289,8 +289,186 @@ sleep 1
 
 # ------------------------------------------------------------------------------
 
+printf "\n %-64s ... \n" "Handle Range Requests"
+
+printf "     %-60s ... " "/song.txt (bytes=0-4)"
+STATUS="HTTP/1.1 206 Partial Content"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -H "Range: bytes=0-4" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != "We go" ] || ! grep_all "Content-Range:.bytes.0-4/227 Content-Length:.5" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (bytes=-5)"
+curl -s -D $WORKSPACE/header -H "Range: bytes=-5" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "Content-Range:.bytes.222-226/227 Content-Length:.5" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# Several ranges of a file are only split into parts once it is cached
+printf "     %-60s ... " "/song.txt (bytes=0-4,10-14)"
+CONTENT="multipart/byteranges;"
+curl -s -o /dev/null $HOST:$PORT/song.txt
+curl -s -D $WORKSPACE/header -H "Range: bytes=0-4,10-14" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "^We.go ^,.dow bytes.0-4/227 bytes.10-14/227" $WORKSPACE/test || ! grep_count Content-Range 2 || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (bytes=1000-)"
+STATUS="HTTP/1.1 416 Range Not Satisfiable"
+CONTENT=""
+curl -s -D $WORKSPACE/header -H "Range: bytes=1000-" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ -s $WORKSPACE/test ] || ! grep_all "Content-Range:.bytes.\*/227" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Conditional Requests"
+
+curl -s -D $WORKSPACE/header -o /dev/null $HOST:$PORT/song.txt
+ETAG=$(awk 'tolower($1) == "etag:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+MODIFIED=$(awk 'tolower($1) == "last-modified:" { $1 = ""; print substr($0, 2) }' $WORKSPACE/header | tr -d '\r\n')
+
+printf "     %-60s ... " "/song.txt (If-None-Match)"
+STATUS="HTTP/1.1 304 Not Modified"
+CONTENT=""
+curl -s -D $WORKSPACE/header -H "If-None-Match: $ETAG" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ -z "$ETAG" ] || [ -s $WORKSPACE/test ] || ! grep_all "ETag Last-Modified" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (If-Modified-Since)"
+curl -s -D $WORKSPACE/header -H "If-Modified-Since: $MODIFIED" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ -z "$MODIFIED" ] || [ -s $WORKSPACE/test ] || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (If-None-Match, stale)"
+MD5SUM=d073749ecc174b560cded952656a4f57
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -H 'If-None-Match: "stale"' -H "If-Modified-Since: $MODIFIED" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (If-Modified-Since, 1970)"
+curl -s -D $WORKSPACE/header -H "If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Content Encoding"
+
+printf "     %-60s ... " "/text/hackers.txt (identity)"
+MD5SUM=c77059544e187022e19b940d0c55f408
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "Vary:.Accept-Encoding" $WORKSPACE/header || grep -q -i Content-Encoding $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt (gzip)"
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: gzip" $HOST:$PORT/text/hackers.txt | gunzip > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "Content-Encoding:.gzip Vary:.Accept-Encoding ETag:.*-gzip" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt (gzip;q=0, identity)"
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: gzip;q=0, identity" $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "Vary:.Accept-Encoding" $WORKSPACE/header || grep -q -i Content-Encoding $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# The brotli representation is the precompressed sidecar, sent as is
+printf "     %-60s ... " "/text/hackers.txt (br sidecar)"
+MD5SUM=df3da66f3ca3fd7fce68bc4d92885056
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: gzip;q=0.5, br" $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "Content-Encoding:.br Vary:.Accept-Encoding ETag:.*-br" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt.br"
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: br" $HOST:$PORT/text/hackers.txt.br > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || grep -q -i "Content-Encoding" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# Files smaller than the compression threshold are never negotiated
+printf "     %-60s ... " "/song.txt (gzip)"
+MD5SUM=d073749ecc174b560cded952656a4f57
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: gzip" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || grep -q -i -E "Content-Encoding|Vary" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
 printf "\n %-64s ... \n" "Handle CGI Requests"
 
+# CGI status lines are parsed and re-sent by the server
+STATUS="HTTP/1.1 200 OK"
+
 printf "     %-60s ... " "/scripts/env.sh"
 CONTENT="text/plain"
 HEADERS="DOCUMENT_ROOT QUERY_STRING REMOTE_ADDR REMOTE_PORT REQUEST_METHOD REQUEST_URI SCRIPT_FILENAME SERVER_PORT HTTP_HOST HTTP_USER_AGENT"
@@ -363,12 +541,85 @@ fi
 
 sleep 1
 
+# Output of unknown length is chunked for HTTP/1.1 and close-delimited for 1.0
+printf "     %-60s ... " "/scripts/env.sh (chunked)"
+CONTENT="text/plain"
+curl -s --raw -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "Transfer-Encoding:.chunked Connection:.keep-alive" $WORKSPACE/header || grep -q -i Content-Length $WORKSPACE/header || [ "$(tail -c 5 $WORKSPACE/test | od -An -c | tr -d ' ')" != '0\r\n\r\n' ] || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/env.sh (HTTP/1.0)"
+curl -s -0 -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$HEADERS" $WORKSPACE/test || ! grep_all "Connection:.close" $WORKSPACE/header || grep -q -i Transfer-Encoding $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/env.sh /song.txt (pipelined)"
+printf "GET /scripts/env.sh HTTP/1.1\r\nHost: $HOST\r\n\r\nGET /song.txt HTTP/1.1\r\nConnection: close\r\n\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test > /dev/null
+if ! check_status $? 0 || [ $(grep -c "HTTP/1.1 200 OK" $WORKSPACE/test) -ne 2 ] || ! grep_all "REQUEST_URI void" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Pooled CGI Requests"
+
+# /scripts/hello.py is served by a pool of 2 persistent workers (-W)
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/html"
+
+printf "     %-60s ... " "/scripts/hello.py (POST user=pparker)"
+curl -s -D $WORKSPACE/header -d user=pparker $HOST:$PORT/scripts/hello.py > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "form input Hello,.pparker" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/hello.py?user=pparker (keep-alive)"
+curl -s -v $HOST:$PORT/scripts/hello.py?user=pparker $HOST:$PORT/scripts/hello.py?user=pparker $HOST:$PORT/scripts/hello.py?user=pparker > $WORKSPACE/test 2> $WORKSPACE/header
+if ! check_status $? 0 || ! grep_count pparker 3 || ! grep_all "Re-using" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/hello.py?user=pparker (8 concurrent)"
+for i in $(seq 8); do
+    curl -s -m 10 $HOST:$PORT/scripts/hello.py?user=pparker &
+done > $WORKSPACE/test
+wait
+if ! grep_count pparker 8; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
 # ------------------------------------------------------------------------------
 
 printf "\n %-64s ... \n" "Handle Errors"
 
 printf "     %-60s ... " "/asdf"
-STATUS="HTTP/1.0 404 Not Found"
+STATUS="HTTP/1.1 404 Not Found"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -380,7 +631,7 @@ fi
 sleep 1
 
 printf "     %-60s ... " "Bad Request"
-STATUS="HTTP/1.0 400 Bad Request"
+STATUS="HTTP/1.1 400 Bad Request"
 CONTENT="text/html"
 nc $HOST $PORT <<<"DERP" |& tee $WORKSPACE/test $WORKSPACE/header > /dev/null
 if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -392,7 +643,7 @@ fi
 sleep 1
 
 printf "     %-60s ... " "Bad Headers"
-STATUS="HTTP/1.0 400 Bad Request"
+STATUS="HTTP/1.1 400 Bad Request"
 CONTENT="text/html"
 printf "GET / HTTP/1.0\r\nHost\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test $WORKSPACE/header > /dev/null
 if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -400,3 +651,174 @@ if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$S
 else
     echo "Success"
 fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Persistent Connections"
+
+printf "     %-60s ... " "/song.txt /text/lyrics.txt (keep-alive)"
+curl -s -v -o /dev/null -o /dev/null $HOST:$PORT/song.txt $HOST:$PORT/text/lyrics.txt 2> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "Content-Length Re-using" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt /text/lyrics.txt (pipelined)"
+printf "GET /song.txt HTTP/1.1\r\nHost: $HOST\r\n\r\nGET /text/lyrics.txt HTTP/1.1\r\nConnection: close\r\n\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test > /dev/null
+if ! check_status $? 0 || [ $(grep -c "HTTP/1.1 200 OK" $WORKSPACE/test) -ne 2 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# Responses to pipelined requests are sent together, so all 10 arrive in
+# fewer TCP segments (as counted by the client's TCP_INFO) than there are
+# responses
+printf "     %-60s ... " "/song.txt x 10 (pipelined, batched)"
+python3 - $HOST $PORT > $WORKSPACE/test <<'EOF'
+import socket, struct, sys
+s = socket.create_connection((sys.argv[1], int(sys.argv[2])))
+s.sendall(b'GET /song.txt HTTP/1.1\r\n\r\n' * 9 + b'GET /song.txt HTTP/1.1\r\nConnection: close\r\n\r\n')
+while s.recv(65536):
+    pass
+print('segments', struct.unpack_from('I', s.getsockopt(socket.IPPROTO_TCP, socket.TCP_INFO, 256), 140)[0])
+EOF
+if ! check_status $? 0 || ! awk '{ exit !($2 < 10) }' $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "HEAD /song.txt, GET /song.txt (pipelined)"
+printf "HEAD /song.txt HTTP/1.1\r\nHost: $HOST\r\n\r\nGET /song.txt HTTP/1.1\r\nConnection: close\r\n\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test > /dev/null
+if ! check_status $? 0 || [ $(grep -c "HTTP/1.1 200 OK" $WORKSPACE/test) -ne 2 ] || ! grep_count void 1; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/asdf /song.txt (keep-alive after error)"
+curl -s -v -o /dev/null -o /dev/null $HOST:$PORT/asdf $HOST:$PORT/song.txt 2> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404 Content-Length Re-using" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (HTTP/1.0)"
+curl -s -v -0 -o /dev/null $HOST:$PORT/song.txt 2> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "Connection:.close" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Request Bodies"
+
+head -c 3000000 /dev/urandom > $WORKSPACE/body
+
+printf "     %-60s ... " "/scripts/echo.sh (3 MB body)"
+MD5SUM=$(md5sum $WORKSPACE/body | awk '{print $1}')
+STATUS="HTTP/1.1 200 OK"
+CONTENT="application/octet-stream"
+curl -s -m 10 -H "Expect:" -D $WORKSPACE/header --data-binary @$WORKSPACE/body $HOST:$PORT/scripts/echo.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/echo.sh (3 MB chunked body)"
+curl -s -m 10 -H "Expect:" -H "Transfer-Encoding: chunked" -D $WORKSPACE/header --data-binary @$WORKSPACE/body $HOST:$PORT/scripts/echo.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/echo.sh (Expect: 100-continue)"
+curl -s -v -m 10 -H "Expect: 100-continue" -o $WORKSPACE/test --data-binary @$WORKSPACE/body $HOST:$PORT/scripts/echo.sh 2> $WORKSPACE/header
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "100.Continue" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# The script reads the body before it writes anything, so the client must
+# get the 100 before its own expect timeout (1 second for curl)
+printf "     %-60s ... " "/scripts/count.sh (Expect: 100-continue)"
+curl -s -m 10 -H "Expect: 100-continue" -w "%{time_total}" -o $WORKSPACE/test --data-binary @$WORKSPACE/body $HOST:$PORT/scripts/count.sh > $WORKSPACE/header
+if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != 3000000 ] || ! awk '{ exit !($1 < 0.5) }' $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (POST, keep-alive)"
+printf "POST /song.txt HTTP/1.1\r\nHost: $HOST\r\nContent-Length: 5\r\n\r\nhelloGET /song.txt HTTP/1.1\r\nConnection: close\r\n\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test > /dev/null
+if ! check_status $? 0 || [ $(grep -c "HTTP/1.1 200 OK" $WORKSPACE/test) -ne 2 ] || ! grep_count void 2; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# Chunk sizes are only hex digits (no sign, whitespace, or 0x prefix)
+STATUS="HTTP/1.1 400 Bad Request"
+CONTENT="text/html"
+for SIZE in zz 0x5 " 5" +5 -5 10000000000000000; do
+    printf "     %-60s ... " "Bad Chunk ($SIZE)"
+    printf "POST /scripts/echo.sh HTTP/1.1\r\nHost: $HOST\r\nTransfer-Encoding: chunked\r\n\r\n$SIZE\r\nhello\r\n0\r\n\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test $WORKSPACE/header > /dev/null
+    if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+
+    sleep 1
+done
+
+# Conflicting body framing could smuggle a request past a proxy
+printf "     %-60s ... " "Transfer-Encoding and Content-Length"
+printf "POST /scripts/echo.sh HTTP/1.1\r\nHost: $HOST\r\nContent-Length: 4\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\nGET /song.txt HTTP/1.1\r\n\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test $WORKSPACE/header > /dev/null
+if ! check_status $? 0 || [ $(grep -c "HTTP/1.1" $WORKSPACE/test) -ne 1 ] || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "Repeated Content-Length"
+printf "POST /scripts/echo.sh HTTP/1.1\r\nHost: $HOST\r\nContent-Length: 4\r\nContent-Length: 40\r\n\r\nabcd" | nc $HOST $PORT |& tee $WORKSPACE/test $WORKSPACE/header > /dev/null
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
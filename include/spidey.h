@@ -2,16 +2,22 @@
 
 #pragma once
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <netdb.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
 
-#define WHITESPACE	" \t\n"
+#define WHITESPACE	" \t\r\n"
+#define CGI_PATH	"/usr/local/bin:/usr/bin:/bin"	/* PATH of CGI scripts if the server has none */
 
 /**
  * Concurrency modes
@@ -19,53 +25,189 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    EVENT,                              /**< Event loop (epoll) */
+    PREFORK,                            /**< Pre-forked worker processes */
+    THREADED,                           /**< Thread pool */
     UNKNOWN
 } ServerMode;
 
+/**
+ * Log levels
+ */
+typedef enum {
+    LEVEL_ERROR,                        /**< Only fatal errors */
+    LEVEL_INFO,                         /**< Server events and failures (log) */
+    LEVEL_DEBUG,                        /**< Per-request tracing (debug) */
+} LogLevel;
+
 /* Global Variables */
 
 extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern int   RootFd;                    /**< Open root directory */
+extern int   Workers;                   /**< Number of worker processes or threads */
+extern int   KeepAliveTimeout;          /**< Idle seconds before closing connection */
+extern size_t FileCacheBudget;          /**< Bytes of file contents to cache */
+extern off_t CompressMinSize;           /**< Smallest file to compress (-1 disables compression) */
+extern off_t MaxBodySize;               /**< Largest request body accepted */
+extern LogLevel Verbosity;              /**< Most detailed messages to print */
+extern bool  NoDelay;                   /**< Whether to disable Nagle's algorithm */
+extern int   SendBufferSize;            /**< Client socket send buffer (0 for default) */
 
 /* Logging Macros */
 
 #ifdef NDEBUG
 #define debug(M, ...)
 #else
-#define debug(M, ...)   fprintf(stderr, "[%5d] DEBUG %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#define debug(M, ...)   (Verbosity >= LEVEL_DEBUG ? (void)fprintf(stderr, "[%5d] DEBUG %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__) : (void)0)
 #endif
 
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
-#define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#define log(M, ...)     (Verbosity >= LEVEL_INFO ? (void)fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__) : (void)0)
 
-/* HTTP Request */
+/* Arena Allocator */
 
-typedef struct header Header;
-struct header {
-    char    *name;                      /*< Name of header entry */
-    char    *data;                      /*< Data of header entry */
-    Header  *next;                      /*< Next header entry */
-};
+#define ARENA_SIZE  BUFSIZ
+
+typedef struct arena_spill ArenaSpill;
+
+typedef struct {
+    char        data[ARENA_SIZE] __attribute__((aligned(16)));  /*< Inline storage */
+    size_t      used;                   /*< Bytes of data allocated */
+    size_t      spilled;                /*< Bytes allocated from the heap */
+    ArenaSpill *spills;                 /*< Allocations that did not fit */
+} Arena;
+
+void *      arena_alloc(Arena *arena, size_t size);
+char *      arena_printf(Arena *arena, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void        arena_reset(Arena *arena);
+void        arena_statistics(size_t *high_water, size_t *spills);
+
+/* HTTP Connection */
+
+typedef struct relay Relay;
 
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *stream;                    /*< Client socket file stream */
-    char    *method;                    /*< HTTP method */
-    char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
-    char    *query;                     /*< HTTP query string */
+    FILE    *stream;                    /*< Client socket output stream (responses) */
 
     char     host[NI_MAXHOST];          /*< Host name of client */
     char     port[NI_MAXSERV];          /*< Port number of client */
 
-    Header  *headers;                   /*< List of name, data Header pairs */
+    char     buffer[BUFSIZ];            /*< Buffered request data */
+    size_t   nbuffer;                   /*< Number of bytes in buffer */
+    size_t   noffset;                   /*< Number of bytes of buffer consumed */
+
+    Arena    arena;                     /*< Allocations of current request */
+
+    bool     nonblocking;               /*< Whether client socket is non-blocking (event loop) */
+    bool     deferrable;                /*< Whether blocking work is left to a helper thread (event loop) */
+    Relay   *relay;                     /*< CGI output left for the event loop to relay (if any) */
+    int      file;                      /*< Open file left for the event loop to send (-1 if none) */
+    off_t    file_offset;               /*< Offset of first byte of file to send */
+    off_t    file_length;               /*< Number of bytes of file to send */
+} Connection;
+
+Connection *accept_connection(int sfd);
+Connection *accept_connection_nonblocking(int sfd);
+void        free_connection(Connection *connection);
+ssize_t     connection_fill(Connection *connection);
+void        connection_compact(Connection *connection);
+bool        connection_pending(Connection *connection);
+
+/* HTTP Request */
+
+#define REQUEST_MAX_HEADERS 64
+
+typedef struct {
+    size_t   offset;                    /*< Offset of field in connection buffer */
+    size_t   length;                    /*< Length of field */
+} Slice;
+
+typedef struct {
+    Slice    name;                      /*< Name of header entry */
+    Slice    data;                      /*< Data of header entry */
+} Header;
+
+typedef enum {
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_HOST,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_RANGE,
+    HEADER_RANGE,
+    HEADER_REFERER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_USER_AGENT,
+    HEADER_UNKNOWN,                     /*< Any other header (and number of known ones) */
+} HeaderName;
+
+typedef enum {
+    REQUEST_METHOD,                     /*< Waiting for request line */
+    REQUEST_HEADERS,                    /*< Waiting for header lines */
+    REQUEST_DONE,                       /*< Request header complete */
+    REQUEST_ERROR,                      /*< Malformed request */
+} RequestState;
+
+typedef enum {
+    BODY_NONE,                          /*< No (more) body to read */
+    BODY_DATA,                          /*< Reading body (or chunk) data */
+    BODY_CHUNK,                         /*< Waiting for chunk size line */
+    BODY_CHUNK_END,                     /*< Waiting for line end after chunk data */
+    BODY_TRAILERS,                      /*< Waiting for end of trailer lines */
+    BODY_ERROR,                         /*< Malformed or too large body */
+} BodyState;
+
+typedef struct request {
+    Connection *connection;             /*< Connection request arrived on */
+    Slice    method;                    /*< HTTP method */
+    Slice    uri;                       /*< HTTP uniform resource identifier */
+    Slice    query;                     /*< HTTP query string */
+    Slice    version;                   /*< HTTP version (empty for HTTP/1.0) */
+    bool     head;                      /*< Whether only the response header is sent (HEAD) */
+    bool     deferred;                  /*< Whether the handler left the request to a helper thread */
+
+    Slice    known[HEADER_UNKNOWN];     /*< Data of known headers (by HeaderName) */
+    Header   unknown[REQUEST_MAX_HEADERS];  /*< Name, data pairs of other headers */
+    size_t   nunknown;                  /*< Number of other headers */
+
+    RequestState state;                 /*< Progress of parser */
+    size_t   nparsed;                   /*< Offset of next line to parse */
+
+    BodyState body;                     /*< Progress of body reader */
+    bool     chunked;                   /*< Whether body is sent in chunks */
+    bool     expect_continue;           /*< Whether client waits for 100 Continue */
+    off_t    nbody;                     /*< Length of body (announced so far, if chunked) */
+    off_t    nremaining;                /*< Bytes of body (or chunk) left to read */
+
+    char    *path;                      /*< Path corrsponding to URI and RootPath */
+    int      fd;                        /*< Open file (or directory) of path */
+
+    bool     keep_alive;                /*< Whether connection persists after response */
+
+    struct timespec started;            /*< When handling began (monotonic) */
+    size_t   nsent;                     /*< Bytes of response written */
+
+    struct request *next;               /*< Next request in freelist */
 } Request;
 
-Request *   accept_request(int sfd);
+Request *   create_request(Connection *connection);
 void	    free_request(Request *request);
 int	    parse_request(Request *request);
+int	    parse_request_buffered(Request *request);
+const char *request_string(Request *request, Slice slice);
+const char *request_header(Request *request, HeaderName name);
+ssize_t     request_body_buffered(Request *request, const char **data);
+void        request_body_consume(Request *request, size_t size);
+void        request_body_discard(Request *request);
 
 /* HTTP Request Handlers */
 
@@ -74,27 +216,147 @@ typedef enum {
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_PARTIAL_CONTENT,	/* 206 Partial Content */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,	/* 416 Range Not Satisfiable */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
 } Status;
 
 Status      handle_request(Request *request);
+void        handle_connection(Connection *connection);
+
+/* HTTP Response Builder */
+
+typedef struct {
+    char     data[BUFSIZ];              /*< Status line and header fields */
+    size_t   length;                    /*< Length of data */
+    bool     truncated;                 /*< Whether a field did not fit */
+} Response;
+
+void        response_start(Response *response, Status status);
+void        response_start_status(Response *response, const char *status);
+void        response_field(Response *response, const char *name, const char *format, ...) __attribute__((format(printf, 3, 4)));
+int         response_finish(Response *response, bool keep_alive);
+int         response_write(Request *request, struct iovec *iov, int iovcnt);
+int         response_send(Request *request, Response *response, struct iovec *body, int nbody);
+
+/* CGI Output Relay */
+
+#define RELAY_SIZE  (64*1024)           /* Most CGI output relayed at once */
+#define RELAY_FRAME 16                  /* Room for chunk framing around relayed output */
+
+struct relay {
+    int      fd;                        /*< Pipe (or worker socket) of CGI output */
+    int      input;                     /*< Pipe (or worker socket) of CGI input (-1 once body is sent) */
+    bool     pipe;                      /*< Whether output can be spliced (fd is a pipe) */
+    bool     http11;                    /*< Whether client speaks HTTP/1.1 */
+    bool     body;                      /*< Whether response has a body (not for HEAD) */
+    bool     keep_alive;                /*< Whether connection persists after response */
+    bool     started;                   /*< Whether response header has been built */
+    bool     chunked;                   /*< Whether body is sent in chunks */
+    bool     finished;                  /*< Whether all of body has been relayed */
+    off_t    remaining;                 /*< Bytes of body left to relay (-1 if unknown) */
+    size_t   nsplice;                   /*< Bytes of current chunk left to splice */
+
+    char     header[BUFSIZ];            /*< CGI header (and start of body) read so far */
+    size_t   nheader;                   /*< Number of bytes in header */
+    size_t   noffset;                   /*< Offset of body in header not yet relayed */
+};
+
+Relay *     relay_create(Request *request, int fd, int input);
+void        relay_free(Relay *relay);
+int         relay_header(Relay *relay, Response *response);
+ssize_t     relay_read(Relay *relay, char *buffer, size_t size);
+size_t      relay_splice_start(Relay *relay, char *frame, size_t *nframe);
+int         relay_upload(Relay *relay, Request *request);
+int         relay_send(Relay *relay, Request *request);
+
+/* File Cache */
+
+typedef struct cached_file CachedFile;
+struct cached_file {
+    dev_t       dev;                    /*< Device of file */
+    ino_t       ino;                    /*< Inode of file */
+    char       *variant;                /*< Variant of response ("" for contents) */
+    off_t       size;                   /*< Size of file when cached */
+    struct timespec mtime;              /*< Modification time when cached */
+
+    char       *data;                   /*< Response header followed by contents */
+    size_t      nheader;                /*< Length of response header */
+    size_t      ndata;                  /*< Length of header and contents */
+
+    size_t      references;             /*< Cache and in-flight responses */
+    CachedFile *chain;                  /*< Next entry in hash bucket */
+    CachedFile *prev;                   /*< More recently used entry */
+    CachedFile *next;                   /*< Less recently used entry */
+};
+
+bool        filecache_fits(size_t size);
+CachedFile *filecache_lookup(struct stat *sb, const char *variant);
+CachedFile *filecache_insert(int fd, struct stat *sb, const char *variant, const char *header);
+CachedFile *filecache_insert_variant(struct stat *sb, const char *variant, const char *header, const char *body, size_t nbody);
+void        filecache_release(CachedFile *file);
+void        filecache_flush(void);
+
+/* Compression */
+
+bool        compress_accepted(const char *header, const char *coding);
+bool        compress_mimetype(const char *mimetype);
+char *      compress_file(int fd, off_t size, size_t *ncompressed);
+
+/* Templates */
+
+int         templates_load(void);
+const char *templates_main(size_t *size);
+const char *templates_error(Status status, bool keep_alive, bool head, size_t *size);
 
 /* HTTP Server */
 
 int         single_server(int sfd);
 int         forking_server(int sfd);
+int         event_server(int sfd);
+int         prefork_server(int sfd);
+int         threaded_server(int sfd);
 
 /* Socket */
 
 int	    socket_listen(const char *port);
+int	    socket_nonblocking(int fd, bool nonblocking);
+int	    socket_cork(int fd, bool cork);
+void	    socket_tune(int fd);
+int	    socket_writev(int fd, struct iovec *iov, int iovcnt);
+
+/* Mime Types */
+
+int	    mimetypes_load(const char *path);
+void	    mimetypes_hangup(int signum);
+void	    mimetypes_refresh(void);
+const char *determine_mimetype(const char *path);
+int	    cache_control_add(const char *rule);
+const char *determine_cache_control(const char *mimetype);
+
+/* CGI Worker Pools */
+
+int         cgipool_add(const char *rule);
+int         cgipool_start(int sfd);
+int         cgipool_find(struct stat *sb);
+int         cgipool_connect(int pool);
+
+/* Access Log */
+
+int         accesslog_open(const char *path);
+void        accesslog_request(Request *request, Status status);
+void        accesslog_flush(void);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	    determine_mimetype(const char *path);
-char *	    determine_request_path(const char *uri);
+int	    open_request_path(const char *uri);
+size_t	    hash_string(const char *s);
 const char *http_status_string(Status status);
+char *	    rstrip(char *s);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
 
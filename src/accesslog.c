@@ -0,0 +1,232 @@
+/* accesslog.c: Asynchronous Access Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+
+#define ACCESSLOG_SLOTS     4096        /* Number of ring slots (power of 2) */
+#define ACCESSLOG_LINE      512         /* Maximum length of a log line */
+#define ACCESSLOG_BATCH     (64 * 1024) /* Bytes written by one write call */
+#define ACCESSLOG_INTERVAL  50          /* Milliseconds between flushes */
+
+/**
+ * Ring buffer slot
+ */
+typedef struct {
+    size_t      sequence;               /*< Position the slot is ready for */
+    size_t      length;                 /*< Length of line */
+    char        line[ACCESSLOG_LINE];   /*< Formatted log line */
+} AccessLogSlot;
+
+/* Global Variables */
+
+static AccessLogSlot   Slots[ACCESSLOG_SLOTS];  /* Ring buffer */
+static size_t          Head     = 0;            /* Next position to claim */
+static size_t          Tail     = 0;            /* Next position to write */
+static size_t          Dropped  = 0;            /* Lines lost to a full ring */
+static int             Fd       = -1;           /* Access log file */
+static bool            Started  = false;        /* Whether writer is running */
+static pthread_mutex_t Drain    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t Start    = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Write all complete lines in ring to access log.
+ *
+ * Lines are gathered into batches of up to ACCESSLOG_BATCH bytes, so a busy
+ * server issues a single write for many requests.
+ **/
+void accesslog_flush(void) {
+    char batch[ACCESSLOG_BATCH];
+    size_t nbatch = 0;
+
+    if (Fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&Drain);
+    while (true) {
+        AccessLogSlot *s = &Slots[Tail & (ACCESSLOG_SLOTS - 1)];
+        bool ready = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) == Tail + 1;
+
+        if (nbatch && (!ready || nbatch + s->length > sizeof(batch))) {
+            if (write(Fd, batch, nbatch) < 0) {
+                debug("Unable to write access log: %s", strerror(errno));
+            }
+            nbatch = 0;
+        }
+        if (!ready) {
+            break;
+        }
+
+        memcpy(batch + nbatch, s->line, s->length);
+        nbatch += s->length;
+        __atomic_store_n(&s->sequence, Tail + ACCESSLOG_SLOTS, __ATOMIC_RELEASE);
+        Tail++;
+    }
+
+    size_t dropped = __atomic_exchange_n(&Dropped, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&Drain);
+
+    if (dropped) {
+        log("Dropped %zu access log lines", dropped);
+    }
+}
+
+/**
+ * Flush ring periodically (writer thread).
+ *
+ * @param   arg         Unused.
+ * @return  NULL (never returns).
+ **/
+static void * accesslog_writer(void *arg) {
+    struct timespec interval = {.tv_nsec = ACCESSLOG_INTERVAL * 1000000L};
+
+    while (true) {
+        nanosleep(&interval, NULL);
+        accesslog_flush();
+    }
+    return NULL;
+}
+
+/**
+ * Start writer thread of this process.
+ **/
+static void accesslog_start(void) {
+    pthread_mutex_lock(&Start);
+    if (!Started) {
+        pthread_t thread;
+        int status = pthread_create(&thread, NULL, accesslog_writer, NULL);
+        if (status != 0) {
+            log("Unable to start access log writer: %s", strerror(status));
+        } else {
+            pthread_detach(thread);
+            __atomic_store_n(&Started, true, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&Start);
+}
+
+/**
+ * Forget writer thread in forked child (which does not inherit it).
+ **/
+static void accesslog_child(void) {
+    Started = false;
+    pthread_mutex_init(&Drain, NULL);
+    pthread_mutex_init(&Start, NULL);
+}
+
+/**
+ * Open access log.
+ *
+ * @param   path        Path to access log file ("-" for stderr).
+ * @return  -1 on error and 0 on success.
+ *
+ * Every process writes its lines with its own writer thread (started on its
+ * first request), and whatever is left in the ring is flushed at exit.  The
+ * file is opened for appending, so batches from concurrent processes do not
+ * overwrite each other.
+ **/
+int accesslog_open(const char *path) {
+    Fd = streq(path, "-") ? STDERR_FILENO : open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (Fd < 0) {
+        log("Unable to open access log %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < ACCESSLOG_SLOTS; i++) {
+        Slots[i].sequence = i;
+    }
+
+    pthread_atfork(NULL, NULL, accesslog_child);
+    atexit(accesslog_flush);
+    return 0;
+}
+
+/**
+ * Format request field for access log.
+ *
+ * @param   r           Request structure.
+ * @param   s           Slice of field.
+ * @return  Field (or "-" if it is empty).
+ **/
+static const char * accesslog_field(Request *r, Slice s) {
+    return s.length ? request_string(r, s) : "-";
+}
+
+/**
+ * Record handled request in access log.
+ *
+ * @param   r           Request structure.
+ * @param   status      HTTP status of response.
+ *
+ * The line is formatted straight into a slot of a lock-free ring buffer
+ * (multiple producers, one consumer) and written later by the writer thread,
+ * so handling a request never waits for the log file.  If the ring is full,
+ * the line is dropped (and counted) rather than blocking.
+ *
+ * Lines are in Common Log Format followed by the handling latency in
+ * microseconds:
+ *
+ *  <HOST> - - [<TIME>] "<METHOD> <URI> <VERSION>" <STATUS> <BYTES> <LATENCY>
+ **/
+void accesslog_request(Request *r, Status status) {
+    if (Fd < 0) {
+        return;
+    }
+
+    if (!__atomic_load_n(&Started, __ATOMIC_ACQUIRE)) {
+        accesslog_start();
+    }
+
+    /* Claim slot */
+    size_t position = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+    AccessLogSlot *s;
+    while (true) {
+        s = &Slots[position & (ACCESSLOG_SLOTS - 1)];
+        size_t sequence = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == position) {
+            if (__atomic_compare_exchange_n(&Head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((ssize_t)(sequence - position) < 0) {
+            __atomic_add_fetch(&Dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            position = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Format line into slot */
+    struct timespec now;
+    struct tm tm;
+    char timestamp[32];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long latency = (now.tv_sec - r->started.tv_sec) * 1000000L + (now.tv_nsec - r->started.tv_nsec) / 1000;
+
+    time_t t = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S %z", localtime_r(&t, &tm));
+
+    int n = snprintf(s->line, sizeof(s->line), "%s - - [%s] \"%s %s %s\" %.3s %zu %ld\n",
+        r->connection->host, timestamp,
+        accesslog_field(r, r->method), accesslog_field(r, r->uri), accesslog_field(r, r->version),
+        http_status_string(status), r->nsent, latency);
+    if (n < 0) {
+        n = 0;
+    } else if ((size_t)n >= sizeof(s->line)) {
+        n = sizeof(s->line) - 1;
+        s->line[n - 1] = '\n';
+    }
+    s->length = n;
+
+    /* Publish slot */
+    __atomic_store_n(&s->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
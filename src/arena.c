@@ -0,0 +1,128 @@
+/* arena.c: Per-Connection Arena Allocator */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+/* Constants */
+
+#define ARENA_ALIGNMENT     16          /* Alignment of every allocation */
+
+/**
+ * Heap allocation that did not fit in an arena
+ */
+struct arena_spill {
+    struct arena_spill *next;           /*< Next spilled allocation */
+    char                data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+/* Global Variables */
+
+static size_t HighWater = 0;            /* Most bytes used by one request */
+static size_t Spills    = 0;            /* Allocations that did not fit */
+
+/**
+ * Allocate memory from arena.
+ *
+ * @param   arena       Arena structure.
+ * @param   size        Number of bytes to allocate.
+ * @return  Pointer to allocated memory (or NULL on error).
+ *
+ * Allocations are carved out of the arena's inline storage.  Anything that
+ * does not fit is allocated from the heap instead and counted as a spill.
+ *
+ * The memory is valid until the arena is reset and must not be free'd.
+ **/
+void * arena_alloc(Arena *arena, size_t size) {
+    size_t offset = (arena->used + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    if (offset <= ARENA_SIZE && size <= ARENA_SIZE - offset) {
+        arena->used = offset + size;
+        return arena->data + offset;
+    }
+
+    ArenaSpill *s = malloc(sizeof(ArenaSpill) + size);
+    if (!s) {
+        debug("Unable to allocate spill: %s", strerror(errno));
+        return NULL;
+    }
+
+    __atomic_add_fetch(&Spills, 1, __ATOMIC_RELAXED);
+    s->next        = arena->spills;
+    arena->spills  = s;
+    arena->spilled += size;
+    return s->data;
+}
+
+/**
+ * Format string into arena.
+ *
+ * @param   arena       Arena structure.
+ * @param   format      printf format string.
+ * @return  Formatted string allocated from arena (or NULL on error).
+ **/
+char * arena_printf(Arena *arena, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (n < 0) {
+        return NULL;
+    }
+
+    char *s = arena_alloc(arena, n + 1);
+    if (s) {
+        va_start(args, format);
+        vsnprintf(s, n + 1, format, args);
+        va_end(args);
+    }
+    return s;
+}
+
+/**
+ * Release all allocations from arena.
+ *
+ * @param   arena       Arena structure.
+ *
+ * Before the arena is emptied, its usage is folded into the high-water mark
+ * reported by arena_statistics.
+ **/
+void arena_reset(Arena *arena) {
+    size_t total = arena->used + arena->spilled;
+    size_t high  = __atomic_load_n(&HighWater, __ATOMIC_RELAXED);
+
+    while (total > high) {
+        if (__atomic_compare_exchange_n(&HighWater, &high, total, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            debug("Arena high-water mark: %zu bytes", total);
+            break;
+        }
+    }
+
+    while (arena->spills) {
+        ArenaSpill *next = arena->spills->next;
+        free(arena->spills);
+        arena->spills = next;
+    }
+
+    arena->used    = 0;
+    arena->spilled = 0;
+}
+
+/**
+ * Report arena usage of this process.
+ *
+ * @param   high_water  Pointer to store most bytes used by one request in.
+ * @param   spills      Pointer to store number of heap allocations in.
+ *
+ * A high-water mark above ARENA_SIZE (or any spills) means the inline
+ * storage is too small for the requests being served.
+ **/
+void arena_statistics(size_t *high_water, size_t *spills) {
+    *high_water = __atomic_load_n(&HighWater, __ATOMIC_RELAXED);
+    *spills     = __atomic_load_n(&Spills, __ATOMIC_RELAXED);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,506 @@
+/* cgipool.c: Persistent CGI Worker Pools */
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CGIPOOL_RULES_MAX   32          /* Most -W rules */
+#define CGIPOOL_MAX         64          /* Most pooled scripts */
+#define CGIPOOL_SIZE        2           /* Default workers per script */
+#define CGIPOOL_BACKOFF     1           /* Seconds before respawning a worker that died right away */
+#define CGIPOOL_FAILURES    3           /* Workers dying right away in a row before a pool is disabled */
+
+/**
+ * Pooled script prefix
+ */
+typedef struct {
+    const char *prefix;                 /*< URI of script or directory of scripts */
+    size_t      nprefix;                /*< Length of prefix */
+    int         size;                   /*< Number of workers per script */
+} CGIPoolRule;
+
+/**
+ * Pool of workers running one script
+ */
+typedef struct {
+    dev_t       dev;                    /*< Device of script */
+    ino_t       ino;                    /*< Inode of script */
+    char        path[PATH_MAX];         /*< Path of script */
+    int         size;                   /*< Number of workers */
+    int         fd;                     /*< Listening socket (-1 outside supervisor) */
+    struct sockaddr_un address;         /*< Address of listening socket */
+    pid_t      *workers;                /*< Process ids of workers (supervisor only) */
+    time_t     *started;                /*< When each worker was (or is to be) spawned (supervisor only) */
+    int         failures;               /*< Workers in a row that died right away (supervisor only) */
+} CGIPool;
+
+/* Global Variables */
+
+static CGIPoolRule  Rules[CGIPOOL_RULES_MAX];       /* Pooled script prefixes */
+static size_t       NRules    = 0;                  /* Number of rules */
+static CGIPool      Pools[CGIPOOL_MAX];             /* Pools (fixed once started) */
+static size_t       NPools    = 0;                  /* Number of pools */
+static char         Directory[] = "/tmp/spidey.XXXXXX"; /* Directory of listening sockets */
+
+static volatile sig_atomic_t Stopping = false;      /* Whether supervisor should stop */
+
+/**
+ * Add pooled script rule.
+ *
+ * @param   rule        Rule of the form <PREFIX>[=<WORKERS>].
+ * @return  -1 on error and 0 on success.
+ *
+ * The prefix is the URI of either an executable or a directory, in which case
+ * every executable directly inside it is pooled.  Later rules override the
+ * number of workers of scripts matched by earlier ones:
+ *
+ *  -W /scripts -W /scripts/hello.py=8
+ *
+ * Rules are only added while parsing options, and the rule string must stay
+ * valid for the lifetime of the server.
+ **/
+int cgipool_add(const char *rule) {
+    const char *equals = strchr(rule, '=');
+    int size = equals ? atoi(equals + 1) : CGIPOOL_SIZE;
+
+    if (rule[0] != '/' || size <= 0 || NRules == CGIPOOL_RULES_MAX) {
+        log("Invalid CGI worker rule: %s", rule);
+        return -1;
+    }
+
+    Rules[NRules++] = (CGIPoolRule){rule, equals ? (size_t)(equals - rule) : strlen(rule), size};
+    return 0;
+}
+
+/**
+ * Add script to pools (or update its number of workers).
+ *
+ * @param   sb          Stat of script.
+ * @param   path        Path of script.
+ * @param   size        Number of workers.
+ **/
+static void cgipool_script(struct stat *sb, const char *path, int size) {
+    if (!S_ISREG(sb->st_mode) || !(sb->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+        return;
+    }
+
+    for (size_t i = 0; i < NPools; i++) {
+        if (Pools[i].dev == sb->st_dev && Pools[i].ino == sb->st_ino) {
+            Pools[i].size = size;
+            return;
+        }
+    }
+
+    if (NPools == CGIPOOL_MAX) {
+        log("Too many pooled scripts, not pooling %s", path);
+        return;
+    }
+
+    CGIPool *p = &Pools[NPools++];
+    p->dev  = sb->st_dev;
+    p->ino  = sb->st_ino;
+    p->size = size;
+    p->fd   = -1;
+    snprintf(p->path, sizeof(p->path), "%s", path);
+}
+
+/**
+ * Add every script matched by rule to pools.
+ *
+ * @param   rule        CGIPoolRule structure.
+ **/
+static void cgipool_resolve(CGIPoolRule *rule) {
+    char uri[PATH_MAX];
+    char path[PATH_MAX];
+    struct stat sb;
+
+    snprintf(uri, sizeof(uri), "%.*s", (int)rule->nprefix, rule->prefix);
+    while (strlen(uri) > 1 && uri[strlen(uri) - 1] == '/') {
+        uri[strlen(uri) - 1] = '\0';
+    }
+
+    int fd = open_request_path(uri);
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        log("Unable to pool %s: %s", uri, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    if (!S_ISDIR(sb.st_mode)) {
+        snprintf(path, sizeof(path), "%s%s", RootPath, uri);
+        cgipool_script(&sb, path, rule->size);
+        close(fd);
+        return;
+    }
+
+    /* Pool executables directly inside directory */
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return;
+    }
+
+    for (struct dirent *e = readdir(d); e; e = readdir(d)) {
+        if (e->d_name[0] == '.' || fstatat(fd, e->d_name, &sb, 0) < 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s%s/%s", RootPath, streq(uri, "/") ? "" : uri, e->d_name) < (int)sizeof(path)) {
+            cgipool_script(&sb, path, rule->size);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Create listening socket of pool.
+ *
+ * @param   p           CGIPool structure.
+ * @param   index       Index of pool.
+ * @return  -1 on error and 0 on success.
+ **/
+static int cgipool_listen(CGIPool *p, size_t index) {
+    p->address.sun_family = AF_UNIX;
+    snprintf(p->address.sun_path, sizeof(p->address.sun_path), "%s/%zu.sock", Directory, index);
+
+    p->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (p->fd < 0 ||
+        bind(p->fd, (struct sockaddr *)&p->address, sizeof(p->address)) < 0 ||
+        listen(p->fd, SOMAXCONN) < 0) {
+        log("Unable to listen on %s: %s", p->address.sun_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Record that the supervisor should stop (SIGINT/SIGTERM handler).
+ *
+ * @param   signum      Signal number.
+ **/
+static void cgipool_stop(int signum) {
+    Stopping = true;
+}
+
+/**
+ * Cut short the pause of the supervisor when a worker dies (SIGCHLD handler).
+ *
+ * @param   signum      Signal number.
+ **/
+static void cgipool_child(int signum) {
+}
+
+/**
+ * Fork and exec worker of pool.
+ *
+ * @param   p           CGIPool structure.
+ * @return  Process id of worker (or -1 on error).
+ *
+ * As with FastCGI, the worker gets the listening socket as its standard
+ * input, accepts one connection per request, and speaks SCGI on it: the
+ * request is a netstring of NUL separated CGI variables (CONTENT_LENGTH
+ * first) followed by the body, and the response is the script's usual CGI
+ * output, ended by closing the connection.
+ *
+ * Like any CGI script, the worker only gets PATH from the server's
+ * environment; its CGI variables arrive with each request.  Its standard
+ * output goes to the server's standard error, so that a script that prints
+ * a plain CGI response instead ends up in the log.
+ **/
+static pid_t cgipool_spawn(CGIPool *p) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to fork worker for %s: %s", p->path, strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        char *argv[] = {p->path, NULL};
+        char  path[BUFSIZ];
+        char *envp[] = {path, NULL};
+
+        snprintf(path, sizeof(path), "PATH=%s", getenv("PATH") ? getenv("PATH") : CGI_PATH);
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+        dup2(p->fd, STDIN_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        execve(p->path, argv, envp);
+        log("Unable to exec %s: %s", p->path, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    debug("Spawned worker %d for %s", pid, p->path);
+    return pid;
+}
+
+/**
+ * Stop pooling script whose workers keep dying right after being spawned.
+ *
+ * @param   p           CGIPool structure.
+ *
+ * This is what happens to scripts that do not speak SCGI (which find a
+ * listening socket rather than a request body on their standard input and
+ * exit), so rather than leaving requests in the listen backlog forever, the
+ * socket is closed and removed: queued requests are reset and later ones
+ * fail to connect, and both get a 500 response.
+ **/
+static void cgipool_disable(CGIPool *p) {
+    log("Workers for %s keep exiting right away (pooled scripts must accept SCGI "
+        "requests on the listening socket of their standard input), no longer pooling it", p->path);
+
+    for (int w = 0; w < p->size; w++) {
+        if (p->workers[w] > 0) {
+            kill(p->workers[w], SIGTERM);
+        }
+        p->workers[w] = -1;
+    }
+
+    close(p->fd);
+    p->fd = -1;
+    unlink(p->address.sun_path);
+}
+
+/**
+ * Keep workers of every pool running (supervisor process).
+ *
+ * @param   parent      Process id of server.
+ *
+ * Workers that die are respawned (after a pause, if they died right after
+ * being spawned, so a broken script cannot make us fork continuously, and
+ * its pool is disabled if that keeps happening; see cgipool_disable).  Each
+ * worker is paused on its own, and the pause is cut short by SIGCHLD, so the
+ * death of one worker is noticed right away even while others are paused.
+ * Workers that could not be forked are retried after the same pause.  The
+ * supervisor stops on SIGINT or SIGTERM, which it also receives when the
+ * server exits, and then terminates the workers and removes the sockets.
+ **/
+static void cgipool_supervise(pid_t parent) {
+    struct sigaction action = {.sa_handler = cgipool_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGHUP, SIG_IGN);
+
+    struct sigaction child = {.sa_handler = cgipool_child};
+    sigaction(SIGCHLD, &child, NULL);
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
+        Stopping = true;
+    }
+
+    /* Allocate workers (which are all due to be spawned) */
+    for (size_t i = 0; i < NPools; i++) {
+        CGIPool *p = &Pools[i];
+        p->workers = calloc(p->size, sizeof(pid_t));
+        p->started = calloc(p->size, sizeof(time_t));
+        if (!p->workers || !p->started) {
+            fatal("Unable to allocate workers: %s", strerror(errno));
+        }
+    }
+
+    /* Spawn workers that are due, and respawn workers as they die */
+    while (!Stopping) {
+        time_t now  = time(NULL);
+        time_t next = 0;
+
+        for (size_t i = 0; i < NPools; i++) {
+            CGIPool *p = &Pools[i];
+            for (int w = 0; p->fd >= 0 && w < p->size; w++) {
+                if (p->workers[w] > 0) {
+                    continue;
+                }
+
+                if (p->started[w] <= now) {
+                    p->workers[w] = cgipool_spawn(p);
+                    p->started[w] = p->workers[w] > 0 ? now : now + CGIPOOL_BACKOFF;
+                }
+                if (p->workers[w] <= 0 && (!next || p->started[w] < next)) {
+                    next = p->started[w];
+                }
+            }
+        }
+
+        /* Only poll while workers are paused, sleeping until the next one
+         * is due (or another dies) */
+        int status;
+        pid_t pid = waitpid(-1, &status, next ? WNOHANG : 0);
+        if (pid == 0 || (pid < 0 && errno == ECHILD)) {
+            if (next) {
+                sleep(next - now);
+            } else {
+                pause();
+            }
+            continue;
+        }
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log("Unable to wait: %s", strerror(errno));
+            break;
+        }
+
+        for (size_t i = 0; i < NPools; i++) {
+            CGIPool *p = &Pools[i];
+            for (int w = 0; w < p->size; w++) {
+                if (p->workers[w] != pid) {
+                    continue;
+                }
+
+                if (WIFSIGNALED(status)) {
+                    log("Worker %d for %s killed by signal %d", pid, p->path, WTERMSIG(status));
+                } else {
+                    log("Worker %d for %s exited with status %d", pid, p->path, WEXITSTATUS(status));
+                }
+
+                p->workers[w] = 0;
+                if (time(NULL) - p->started[w] > CGIPOOL_BACKOFF) {
+                    p->failures = 0;
+                } else if (++p->failures >= CGIPOOL_FAILURES) {
+                    cgipool_disable(p);
+                } else {
+                    p->started[w] = time(NULL) + CGIPOOL_BACKOFF;
+                }
+            }
+        }
+    }
+
+    /* Terminate workers and remove sockets */
+    for (size_t i = 0; i < NPools; i++) {
+        for (int w = 0; Pools[i].workers && w < Pools[i].size; w++) {
+            if (Pools[i].workers[w] > 0) {
+                kill(Pools[i].workers[w], SIGTERM);
+            }
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR);
+
+    for (size_t i = 0; i < NPools; i++) {
+        unlink(Pools[i].address.sun_path);
+    }
+    rmdir(Directory);
+}
+
+/**
+ * Start worker pools of pooled scripts.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  -1 on error and 0 on success.
+ *
+ * The scripts matched by the rules are resolved once (beneath RootFd), a
+ * listening socket is created for each of them in a private directory, and a
+ * supervisor process is forked off to run their workers.
+ *
+ * The server only keeps the socket addresses, so any server process (in any
+ * mode) connects to a pool for each request (see cgipool_connect).  Requests
+ * are queued in the listen backlog until a worker is idle to accept them.
+ **/
+int cgipool_start(int sfd) {
+    if (NRules == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < NRules; i++) {
+        cgipool_resolve(&Rules[i]);
+    }
+    if (NPools == 0) {
+        log("No CGI scripts to pool");
+        return 0;
+    }
+
+    if (!mkdtemp(Directory)) {
+        log("Unable to create socket directory: %s", strerror(errno));
+        NPools = 0;
+        return -1;
+    }
+
+    for (size_t i = 0; i < NPools; i++) {
+        if (cgipool_listen(&Pools[i], i) < 0) {
+            goto fail;
+        }
+        log("Pooling %d workers for %s", Pools[i].size, Pools[i].path);
+    }
+
+    pid_t parent = getpid();
+    pid_t pid    = fork();
+    if (pid < 0) {
+        log("Unable to fork supervisor: %s", strerror(errno));
+        goto fail;
+    }
+    if (pid == 0) {
+        close(sfd);
+        cgipool_supervise(parent);
+        _exit(EXIT_SUCCESS);
+    }
+
+    for (size_t i = 0; i < NPools; i++) {
+        close(Pools[i].fd);
+        Pools[i].fd = -1;
+    }
+    return 0;
+
+fail:
+    for (size_t i = 0; i < NPools; i++) {
+        if (Pools[i].fd >= 0) {
+            close(Pools[i].fd);
+            unlink(Pools[i].address.sun_path);
+        }
+    }
+    rmdir(Directory);
+    NPools = 0;
+    return -1;
+}
+
+/**
+ * Find pool of script.
+ *
+ * @param   sb          Stat of script.
+ * @return  Index of pool (or -1 if the script is not pooled).
+ **/
+int cgipool_find(struct stat *sb) {
+    for (size_t i = 0; i < NPools; i++) {
+        if (Pools[i].dev == sb->st_dev && Pools[i].ino == sb->st_ino) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Connect to worker of pool.
+ *
+ * @param   pool        Index of pool.
+ * @return  Connected socket (or -1 on error).
+ **/
+int cgipool_connect(int pool) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&Pools[pool].address, sizeof(Pools[pool].address)) < 0) {
+        log("Unable to connect to workers of %s: %s", Pools[pool].path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,170 @@
+/* compress.c: Response Compression */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+
+/* Constants */
+
+#define COMPRESS_LEVEL      6           /* zlib compression level */
+#define COMPRESS_GZIP       (15 + 16)   /* zlib window bits for a gzip stream */
+
+/* Global Variables */
+
+static const char *CompressibleTypes[] = {  /* Mimetypes worth compressing (besides text/ and +xml or +json) */
+    "application/javascript",
+    "application/json",
+    "application/x-javascript",
+    "application/xml",
+};
+
+static const size_t NCompressibleTypes = sizeof(CompressibleTypes) / sizeof(CompressibleTypes[0]);
+
+/**
+ * Determine whether client accepts content coding.
+ *
+ * @param   header      Data of Accept-Encoding header.
+ * @param   coding      Content coding (i.e. gzip).
+ * @return  Whether the coding (or *) is listed with a nonzero quality.
+ *
+ * The header is a list of codings with optional qualities:
+ *
+ *  gzip, deflate;q=0.5, br;q=0, *;q=0.1
+ *
+ * A coding that is listed explicitly takes precedence over *.
+ **/
+bool compress_accepted(const char *header, const char *coding) {
+    size_t n   = strlen(coding);
+    double any = 0;
+
+    for (const char *s = header; *s; ) {
+        while (*s == ' ' || *s == '\t' || *s == ',') {
+            s++;
+        }
+
+        const char *token = s;
+        while (*s && *s != ',' && *s != ';' && *s != ' ' && *s != '\t') {
+            s++;
+        }
+        size_t ntoken = s - token;
+
+        /* Parse parameters for quality */
+        double quality = 1;
+        while (*s && *s != ',') {
+            if (*s == ';') {
+                s = skip_whitespace((char *)s + 1);
+                if ((s[0] == 'q' || s[0] == 'Q') && s[1] == '=') {
+                    quality = strtod(s + 2, (char **)&s);
+                }
+            } else {
+                s++;
+            }
+        }
+
+        if (ntoken == n && strncasecmp(token, coding, n) == 0) {
+            return quality > 0;
+        }
+        if (ntoken == 1 && token[0] == '*') {
+            any = quality;
+        }
+    }
+
+    return any > 0;
+}
+
+/**
+ * Determine whether files of mimetype are worth compressing.
+ *
+ * @param   mimetype    Mimetype of file.
+ * @return  Whether the mimetype is text (images, archives, and the like are
+ * already compressed).
+ **/
+bool compress_mimetype(const char *mimetype) {
+    if (strncmp(mimetype, "text/", 5) == 0) {
+        return true;
+    }
+
+    size_t n = strlen(mimetype);
+    if ((n > 4 && streq(mimetype + n - 4, "+xml")) || (n > 5 && streq(mimetype + n - 5, "+json"))) {
+        return true;
+    }
+
+    for (size_t i = 0; i < NCompressibleTypes; i++) {
+        if (streq(mimetype, CompressibleTypes[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Compress file with gzip.
+ *
+ * @param   fd          Open file descriptor of file.
+ * @param   size        Size of file.
+ * @param   ncompressed Pointer to store length of compressed data in.
+ * @return  Newly allocated compressed data (or NULL on error).
+ *
+ * The file is read a buffer at a time, so only the compressed data has to be
+ * held in memory.  If the file changes size underneath us, then give up.
+ *
+ * The returned data must be free'd.
+ **/
+char * compress_file(int fd, off_t size, size_t *ncompressed) {
+    char buffer[BUFSIZ];
+    z_stream z = {0};
+    char *data = NULL;
+    off_t offset = 0;
+
+    if (deflateInit2(&z, COMPRESS_LEVEL, Z_DEFLATED, COMPRESS_GZIP, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        debug("Unable to initialize zlib: %s", z.msg ? z.msg : "unknown error");
+        return NULL;
+    }
+
+    /* The bound covers the whole stream, so deflate never runs out of room */
+    size_t bound = deflateBound(&z, size);
+    if (!(data = malloc(bound))) {
+        debug("Unable to allocate compressed data: %s", strerror(errno));
+        goto fail;
+    }
+    z.next_out  = (Bytef *)data;
+    z.avail_out = bound;
+
+    int status = Z_OK;
+    while (status == Z_OK) {
+        size_t  nwant = size - offset < BUFSIZ ? size - offset : BUFSIZ;
+        ssize_t nread = nwant ? pread(fd, buffer, nwant, offset) : 0;
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread < 0 || (size_t)nread != nwant) {
+            debug("Unable to read file: %s", nread < 0 ? strerror(errno) : "file changed");
+            goto fail;
+        }
+        offset += nread;
+
+        z.next_in  = (Bytef *)buffer;
+        z.avail_in = nread;
+        status = deflate(&z, offset == size ? Z_FINISH : Z_NO_FLUSH);
+    }
+
+    if (status != Z_STREAM_END) {
+        debug("Unable to compress file: %s", z.msg ? z.msg : "unknown error");
+        goto fail;
+    }
+
+    *ncompressed = z.total_out;
+    deflateEnd(&z);
+    return data;
+
+fail:
+    deflateEnd(&z);
+    free(data);
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
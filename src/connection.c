@@ -0,0 +1,218 @@
+/* connection.c: HTTP Connection Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/**
+ * Accept client connection from server socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   flags       Flags passed to accept4 for the client socket.
+ * @return  Newly allocated Connection structure (without a socket stream).
+ **/
+static Connection * accept_client(int sfd, int flags) {
+
+    /* Allocate connection struct (zeroed) */
+    Connection *c = calloc(1, sizeof(Connection));
+    if ( !c ) {
+        debug("Unable to allocate connection: %s", strerror(errno));
+        return NULL;
+    }
+
+    c->file = -1;
+
+    /* Accept a client */
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
+    c->fd = accept4(sfd, (struct sockaddr *)&raddr, &rlen, flags);
+    if (c->fd < 0) {
+        debug("Unable to accept: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* Apply socket tunables */
+    socket_tune(c->fd);
+
+    /* Lookup client information */
+    int status = getnameinfo((struct sockaddr *)&raddr, rlen, c->host, sizeof(c->host), c->port, sizeof(c->port), NI_NUMERICHOST | NI_NUMERICSERV);
+    if (status != 0) {
+        debug("Unable to accept: %s", gai_strerror(status));
+        goto fail;
+    }
+
+    return c;
+
+fail:
+    /* Deallocate connection struct */
+    free_connection(c);
+    return NULL;
+}
+
+/**
+ * Accept connection from server socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Newly allocated Connection structure.
+ *
+ * This function does the following:
+ *
+ *  1. Allocates a connection struct initialized to 0.
+ *  2. Accepts a client connection from the server socket.
+ *  3. Applies the client socket tunables (see socket_tune).
+ *  4. Looks up the client information and stores it in the connection struct.
+ *  5. Sets the idle timeout for reading requests from the client socket.
+ *  6. Opens the client socket output stream for the connection struct.
+ *  7. Returns the connection struct.
+ *
+ * Requests are not read through a stream, but from the connection buffer (see
+ * connection_fill).
+ *
+ * The returned connection struct must be deallocated using free_connection.
+ **/
+Connection * accept_connection(int sfd) {
+    Connection *c = accept_client(sfd, SOCK_CLOEXEC);
+    if ( !c ) {
+        return NULL;
+    }
+
+    /* Bound how long we wait for the (next) request */
+    struct timeval timeout = {.tv_sec = KeepAliveTimeout};
+    if (KeepAliveTimeout > 0 && setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        debug("Unable to set timeout: %s", strerror(errno));
+    }
+
+    /* Open socket stream */
+    c->stream = fdopen(c->fd, "w");
+    if ( !c->stream) {
+        debug("Unable to fdopen: %s", strerror(errno));
+        free_connection(c);
+        return NULL;
+    }
+
+    debug("Accepted connection from %s:%s", c->host, c->port);
+    return c;
+}
+
+/**
+ * Accept non-blocking connection from server socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Newly allocated Connection structure.
+ *
+ * This is the same as accept_connection except that the client socket is put
+ * into non-blocking mode and no socket stream is opened: the caller is
+ * responsible for attaching a stream (see event.c) before handling each
+ * request, and for relaying any CGI output the handler leaves in relay (or
+ * sending the file it leaves in file).
+ *
+ * The returned connection struct must be deallocated using free_connection.
+ **/
+Connection * accept_connection_nonblocking(int sfd) {
+    Connection *c = accept_client(sfd, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ( !c ) {
+        return NULL;
+    }
+    c->nonblocking = true;
+
+    debug("Accepted connection from %s:%s", c->host, c->port);
+    return c;
+}
+
+/**
+ * Deallocate connection struct.
+ *
+ * @param   c           Connection structure.
+ *
+ * This closes the connection socket stream or file descriptor (and any CGI
+ * output still being relayed or file still being sent), releases the
+ * connection arena, and then frees the connection struct.
+ **/
+void free_connection(Connection *c) {
+    if (!c) {
+    	return;
+    }
+
+    relay_free(c->relay);
+    if (c->file >= 0) {
+        close(c->file);
+    }
+
+    /* Close socket stream or fd */
+    if ( c->stream )
+        fclose(c->stream);
+    else if ( c->fd >= 0 )
+        close(c->fd);
+
+    arena_reset(&c->arena);
+    free(c);
+
+    size_t high_water, spills;
+    arena_statistics(&high_water, &spills);
+    debug("Arena usage: %zu bytes high-water, %zu spills", high_water, spills);
+}
+
+/**
+ * Read more request data from client socket into connection buffer.
+ *
+ * @param   c           Connection structure.
+ * @return  Number of bytes read (0 on end of stream or when the buffer is
+ * full, and -1 on error).
+ *
+ * Any pending responses are flushed first, since a pipelining client may be
+ * waiting for them before it sends anything else.
+ *
+ * Data already in the buffer is never moved (see connection_compact), so
+ * the request being parsed stays valid.
+ *
+ * For non-blocking sockets, -1 with errno set to EAGAIN means that no more
+ * data is available right now.
+ **/
+ssize_t connection_fill(Connection *c) {
+    if (c->stream && fflush(c->stream) != 0) {
+        return -1;
+    }
+
+    if (c->nbuffer == sizeof(c->buffer)) {
+        return 0;
+    }
+
+    ssize_t n = recv(c->fd, c->buffer + c->nbuffer, sizeof(c->buffer) - c->nbuffer, 0);
+    if (n > 0) {
+        c->nbuffer += n;
+    }
+    return n;
+}
+
+/**
+ * Discard consumed data from front of connection buffer.
+ *
+ * @param   c           Connection structure.
+ *
+ * This moves any unconsumed (pipelined) data to the front of the buffer, so
+ * it must only be called between requests.
+ **/
+void connection_compact(Connection *c) {
+    if (c->noffset) {
+        memmove(c->buffer, c->buffer + c->noffset, c->nbuffer - c->noffset);
+        c->nbuffer -= c->noffset;
+        c->noffset  = 0;
+    }
+}
+
+/**
+ * Determine whether the connection buffer has unconsumed request data.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether or not (part of) another request is already buffered.
+ **/
+bool connection_pending(Connection *c) {
+    return c->noffset < c->nbuffer;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
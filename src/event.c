@@ -0,0 +1,1173 @@
+/* event.c: Event-Driven HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define EVENT_MAX_EVENTS    256         /* Events returned per epoll_wait */
+#define EVENT_SWEEP_MS      1000        /* Interval between idle sweeps */
+#define EVENT_BATCH_SIZE    (64*1024)   /* Pending output that forces a send */
+#define EVENT_HELPERS       4           /* Fewest helper threads (they mostly block) */
+
+/**
+ * Client connection states
+ */
+typedef enum {
+    CLIENT_READING,                     /**< Waiting for request header */
+    CLIENT_WRITING,                     /**< Draining pending responses */
+    CLIENT_UPLOADING,                   /**< Sending request body to CGI script */
+    CLIENT_RELAYING,                    /**< Relaying CGI output */
+    CLIENT_HANDLING,                    /**< Request left to a helper thread */
+} ClientState;
+
+/**
+ * Event loop client connection
+ */
+typedef struct client Client;
+struct client {
+    Connection *connection;             /*< Client connection */
+    ClientState state;                  /*< Current state of connection */
+    uint32_t    events;                 /*< Events registered with epoll (0 if none) */
+    uint32_t    relay_events;           /*< Events of CGI output registered with epoll */
+    uint32_t    input_events;           /*< Events of CGI input registered with epoll */
+    Request    *request;                /*< Request being parsed or responded to (if any) */
+    Status      status;                 /*< Status of response being sent */
+    bool        sending;                /*< Whether request is handled, but not yet logged */
+    bool        keep_alive;             /*< Whether to persist after responses */
+    bool        eof;                    /*< Whether client closed its end */
+    bool        stalled;                /*< Whether client socket is full while splicing */
+    bool        full;                   /*< Whether CGI input is full while uploading */
+
+    char       *output;                 /*< Pending response bytes */
+    size_t      noutput;                /*< Number of bytes in output */
+    size_t      ncapacity;              /*< Allocated size of output */
+    size_t      nsent;                  /*< Number of output bytes sent */
+
+    int         file;                   /*< File to send after output (-1 if none) */
+    off_t       file_offset;            /*< Offset of next byte of file to send */
+    off_t       file_remaining;         /*< Bytes of file left to send */
+
+    time_t      deadline;               /*< Time at which client is idle */
+    Client     *prev;                   /*< Previous client in idle order */
+    Client     *next;                   /*< Next client in idle order */
+    Client     *queued;                 /*< Next client left to (or by) helpers */
+};
+
+/* Global Variables */
+
+static Client *IdleHead = NULL;         /* Least recently active client */
+static Client *IdleTail = NULL;         /* Most recently active client */
+static Client *Closed   = NULL;         /* Clients left to deallocate */
+
+static pthread_mutex_t Lock     = PTHREAD_MUTEX_INITIALIZER;    /* Protects the lists below */
+static pthread_cond_t  Ready    = PTHREAD_COND_INITIALIZER;     /* Signals deferred clients */
+static Client         *Deferred = NULL;     /* Oldest client left to helpers */
+static Client         *LastDeferred = NULL; /* Newest client left to helpers */
+static Client         *Handled  = NULL;     /* Clients helpers are done with */
+static int             Notify   = -1;       /* Eventfd helpers signal the loop with */
+
+/* Client Stream Functions */
+
+/**
+ * Record request whose response the loop finished sending, and release it.
+ *
+ * @param   c           Client structure.
+ *
+ * Handled requests are kept while their response is still being sent (the
+ * body of an uncached file or relayed CGI output), so they are logged with
+ * the bytes that were actually sent and the time it took (see
+ * handle_request).  A request whose connection is lost first is logged with
+ * what was sent up to then.
+ **/
+static void client_finish(Client *c) {
+    Request *r = c->request;
+
+    if (c->sending) {
+        if (c->file >= 0) {
+            r->nsent -= c->file_remaining;
+        }
+        accesslog_request(r, c->status);
+    }
+
+    free_request(r);
+    c->request = NULL;
+    c->sending = false;
+}
+
+/**
+ * Send as much pending output to client socket as it accepts.
+ *
+ * @param   c           Client structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Once the output buffer is sent, any file left by the handler follows it
+ * straight from the page cache with sendfile (while the output before it is
+ * sent with MSG_MORE, so the header shares frames with the file).  At most
+ * EVENT_BATCH_SIZE bytes of the file are sent per call, so a fast client
+ * cannot starve the other clients.
+ **/
+static int client_send(Client *c) {
+    int more = c->file >= 0 ? MSG_MORE : 0;
+
+    while (c->nsent < c->noutput) {
+        ssize_t n = send(c->connection->fd, c->output + c->nsent, c->noutput - c->nsent, MSG_NOSIGNAL | more);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            debug("Unable to send: %s", strerror(errno));
+            return -1;
+        }
+        c->nsent += n;
+    }
+
+    if (c->nsent < c->noutput) {
+        return 0;
+    }
+    c->noutput = 0;
+    c->nsent   = 0;
+
+    for (size_t nbatch = 0; c->file >= 0 && c->file_remaining > 0 && nbatch < EVENT_BATCH_SIZE; ) {
+        size_t  nwant = EVENT_BATCH_SIZE - nbatch;
+        ssize_t n     = sendfile(c->connection->fd, c->file, &c->file_offset,
+                                 (off_t)nwant < c->file_remaining ? nwant : (size_t)c->file_remaining);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            /* Header already promised more than was sent */
+            debug("Unable to sendfile: %s", n < 0 ? strerror(errno) : "end of file");
+            return -1;
+        }
+        c->file_remaining -= n;
+        nbatch += n;
+    }
+
+    if (c->file >= 0 && c->file_remaining == 0) {
+        close(c->file);
+        c->file = -1;
+        if (c->sending) {
+            client_finish(c);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Determine whether client has response data left to send.
+ *
+ * @param   c           Client structure.
+ * @return  Whether any output (or file) is pending.
+ **/
+static bool client_pending(Client *c) {
+    return c->nsent < c->noutput || c->file >= 0;
+}
+
+/**
+ * Make room in client output buffer.
+ *
+ * @param   c           Client structure.
+ * @param   size        Number of bytes to make room for.
+ * @return  -1 on error and 0 on success.
+ **/
+static int client_reserve(Client *c, size_t size) {
+    if (c->noutput + size > c->ncapacity) {
+        size_t ncapacity = c->ncapacity ? c->ncapacity : BUFSIZ;
+        while (ncapacity < c->noutput + size) {
+            ncapacity *= 2;
+        }
+
+        char *output = realloc(c->output, ncapacity);
+        if (!output) {
+            debug("Unable to allocate output: %s", strerror(errno));
+            return -1;
+        }
+        c->output    = output;
+        c->ncapacity = ncapacity;
+    }
+    return 0;
+}
+
+/**
+ * Write to client output buffer (fopencookie write function).
+ *
+ * @param   cookie      Client structure.
+ * @param   buffer      Data to write.
+ * @param   size        Size of data.
+ * @return  Number of bytes written (or -1 on error).
+ *
+ * Data is appended to the output buffer, so responses to pipelined requests
+ * are sent together.  Once EVENT_BATCH_SIZE bytes are pending, as much as
+ * the socket accepts is sent right away to bound the buffer for large
+ * responses.
+ **/
+static ssize_t client_stream_write(void *cookie, const char *buffer, size_t size) {
+    Client *c = cookie;
+
+    if (client_reserve(c, size) < 0) {
+        return -1;
+    }
+
+    memcpy(c->output + c->noutput, buffer, size);
+    c->noutput += size;
+
+    if (c->noutput - c->nsent >= EVENT_BATCH_SIZE && client_send(c) < 0) {
+        return -1;
+    }
+    return size;
+}
+
+static cookie_io_functions_t ClientStreamFunctions = {
+    .write  = client_stream_write,
+};
+
+/* Client Functions */
+
+/**
+ * Move client to the end of the idle list and extend its deadline.
+ *
+ * @param   c           Client structure.
+ **/
+static void client_touch(Client *c) {
+    /* Unlink */
+    if (c->prev) c->prev->next = c->next; else if (IdleHead == c) IdleHead = c->next;
+    if (c->next) c->next->prev = c->prev; else if (IdleTail == c) IdleTail = c->prev;
+
+    /* Append */
+    c->prev = IdleTail;
+    c->next = NULL;
+    if (IdleTail) IdleTail->next = c; else IdleHead = c;
+    IdleTail = c;
+
+    c->deadline = time(NULL) + KeepAliveTimeout;
+}
+
+/**
+ * Parse the next request in the connection buffer as far as possible.
+ *
+ * @param   c           Client structure.
+ * @return  Whether or not the request can be handled.
+ *
+ * The request is kept in the client between calls, so parsing resumes where
+ * it stopped once more data arrives.  If the client has closed its end, then
+ * an incomplete request is handled anyway (and rejected).
+ **/
+static bool client_parse(Client *c) {
+    if (!c->request) {
+        if (!connection_pending(c->connection)) {
+            return false;
+        }
+
+        if (!(c->request = create_request(c->connection))) {
+            return false;
+        }
+    }
+
+    return parse_request_buffered(c->request) <= 0 || c->eof;
+}
+
+/**
+ * Register, modify, or remove events of client file descriptor.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @param   fd          Client socket or CGI output.
+ * @param   registered  Pointer to events currently registered (0 if none).
+ * @param   events      Events to register (0 to remove).
+ * @return  -1 on error and 0 on success.
+ **/
+static int client_register(int efd, Client *c, int fd, uint32_t *registered, uint32_t events) {
+    if (events == *registered) {
+        return 0;
+    }
+
+    int op = !*registered ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    struct epoll_event event = {.events = events, .data.ptr = c};
+    if (epoll_ctl(efd, op, fd, &event) < 0) {
+        log("Unable to modify client: %s", strerror(errno));
+        return -1;
+    }
+    *registered = events;
+    return 0;
+}
+
+/**
+ * Update the events the client is registered for to match its state.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * While CGI output is relayed, only one of the client socket (while output
+ * is pending or splicing is stalled) and the CGI output (otherwise) is
+ * registered.  While a request body is sent to a CGI script, the output is
+ * relayed all the same, and in addition either the client socket is watched
+ * for more of the body or the CGI input for room (while it is full).  This
+ * way, every event of the client means the upload or relay can make
+ * progress, and neither waits for the other.
+ *
+ * Nothing is registered while a helper thread handles the request (which
+ * may leave a relay in the connection meanwhile).
+ **/
+static int client_watch(int efd, Client *c) {
+    if (c->state == CLIENT_HANDLING) {
+        return client_register(efd, c, c->connection->fd, &c->events, 0);
+    }
+
+    Relay   *relay        = c->connection->relay;
+    uint32_t events       = 0;
+    uint32_t relay_events = 0;
+    uint32_t input_events = 0;
+
+    if (c->state == CLIENT_READING) {
+        events = EPOLLIN;
+    } else if (c->state == CLIENT_WRITING) {
+        events = EPOLLOUT;
+    } else {
+        if (c->nsent < c->noutput || c->stalled) {
+            events = EPOLLOUT;
+        } else if (!relay->finished) {
+            relay_events = EPOLLIN;
+        }
+
+        if (c->state == CLIENT_UPLOADING && c->full) {
+            input_events = EPOLLOUT;
+        } else if (c->state == CLIENT_UPLOADING) {
+            events |= EPOLLIN;
+        }
+    }
+
+    if (client_register(efd, c, c->connection->fd, &c->events, events) < 0) {
+        return -1;
+    }
+    if (relay && client_register(efd, c, relay->fd, &c->relay_events, relay_events) < 0) {
+        return -1;
+    }
+    if (relay && relay->input >= 0) {
+        return client_register(efd, c, relay->input, &c->input_events, input_events);
+    }
+    return 0;
+}
+
+/**
+ * Deallocate relay of client (closing the CGI output and input).
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ *
+ * The descriptors are removed from epoll before they are closed: a CGI script
+ * that is still being started may share them until its exec closes them (and
+ * the input of a pooled worker shares its socket with the output), so closing
+ * them alone does not necessarily remove them.
+ **/
+static void client_relay_free(int efd, Client *c) {
+    Relay *relay = c->connection->relay;
+
+    client_register(efd, c, relay->fd, &c->relay_events, 0);
+    if (relay->input >= 0) {
+        client_register(efd, c, relay->input, &c->input_events, 0);
+    }
+    relay_free(relay);
+    c->connection->relay = NULL;
+}
+
+/**
+ * Deallocate client and its connection (closing the socket).
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ *
+ * Like those of the relay (see client_relay_free), the socket is removed
+ * from epoll before it is closed.  Further events of the client may still be
+ * among those being dispatched, though, so only its connection is closed
+ * right away, and the client itself is deallocated once the events have been
+ * dispatched (see client_collect).
+ **/
+static void client_free(int efd, Client *c) {
+    if (c->prev) c->prev->next = c->next; else IdleHead = c->next;
+    if (c->next) c->next->prev = c->prev; else IdleTail = c->prev;
+
+    client_register(efd, c, c->connection->fd, &c->events, 0);
+    if (c->connection->relay) {
+        client_relay_free(efd, c);
+    }
+
+    client_finish(c);
+    free_connection(c->connection);
+    free(c->output);
+    if (c->file >= 0) {
+        close(c->file);
+    }
+
+    c->connection = NULL;
+    c->next       = Closed;
+    Closed        = c;
+}
+
+/**
+ * Deallocate clients closed by client_free.
+ **/
+static void client_collect() {
+    while (Closed) {
+        Client *c = Closed;
+        Closed = c->next;
+        free(c);
+    }
+}
+
+/* Event Functions */
+
+/**
+ * Accept all pending client connections and register them for input events.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   sfd         Server socket file descriptor.
+ **/
+static void event_accept(int efd, int sfd) {
+    while (true) {
+        Connection *connection = accept_connection_nonblocking(sfd);
+        if (!connection) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log("Unable to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        Client *c = calloc(1, sizeof(Client));
+        if (!c) {
+            log("Unable to allocate client: %s", strerror(errno));
+            free_connection(connection);
+            continue;
+        }
+        c->connection = connection;
+        c->state      = CLIENT_READING;
+        c->keep_alive = true;
+        c->file       = -1;
+        client_touch(c);
+
+        if (client_register(efd, c, connection->fd, &c->events, EPOLLIN) < 0) {
+            client_free(efd, c);
+        }
+    }
+}
+
+/**
+ * Finish handling request once the handler is done with it.
+ *
+ * @param   c           Client structure.
+ * @return  -1 on error and 0 on success.
+ **/
+static int event_handled(Client *c) {
+    Connection *connection = c->connection;
+    Request    *r          = c->request;
+
+    /* Keep request until the rest of its response is sent (see
+     * client_finish) */
+    c->keep_alive = r->keep_alive;
+    c->sending    = connection->relay || connection->file >= 0;
+    if (!c->sending) {
+        c->request = NULL;
+        free_request(r);
+    }
+
+    /* Flush response into output buffer */
+    int status = fclose(connection->stream);
+    connection->stream = NULL;
+
+    /* Take over file left to send after the response (see client_send) */
+    if (connection->file >= 0) {
+        c->file           = connection->file;
+        c->file_offset    = connection->file_offset;
+        c->file_remaining = connection->file_length;
+        connection->file  = -1;
+    }
+    return status == 0 ? 0 : -1;
+}
+
+/**
+ * Handle the parsed request.
+ *
+ * @param   c           Client structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * The response is appended to the client output buffer, except for the
+ * body of an uncached file, which is sent after it (see client_send).  If
+ * the request body still has to be sent to a CGI script, then the request
+ * is kept until it has been (see event_upload).
+ *
+ * If the handler defers the request (see handle_defer), then the client is
+ * left to a helper thread until it is done (see event_helper).
+ **/
+static int event_handle(Client *c) {
+    Connection *connection = c->connection;
+    Request    *r          = c->request;
+
+    /* Attach stream that writes to the output buffer */
+    connection->stream = fopencookie(c, "w", ClientStreamFunctions);
+    if (!connection->stream) {
+        log("Unable to open client stream: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Handle request */
+    connection->deferrable = true;
+    c->status = handle_request(r);
+
+    if (r->deferred) {
+        c->state  = CLIENT_HANDLING;
+        c->queued = NULL;
+
+        pthread_mutex_lock(&Lock);
+        if (LastDeferred) LastDeferred->queued = c; else Deferred = c;
+        LastDeferred = c;
+        pthread_cond_signal(&Ready);
+        pthread_mutex_unlock(&Lock);
+        return 0;
+    }
+
+    return event_handled(c);
+}
+
+/**
+ * Handle buffered requests and send their responses.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @return  Whether or not the client is finished (and should be freed).
+ *
+ * Every complete request in the connection buffer is handled in order
+ * before anything is sent, so the responses to pipelined requests go out in
+ * as few send calls as possible.
+ **/
+static bool event_upload(int efd, Client *c);
+static bool event_relay(int efd, Client *c);
+
+static bool event_process(int efd, Client *c) {
+    bool held;
+
+    do {
+        while (c->keep_alive && !c->connection->relay && c->file < 0 && c->noutput - c->nsent < EVENT_BATCH_SIZE && client_parse(c)) {
+            if (event_handle(c) < 0) {
+                return true;
+            }
+
+            /* Wait for helper thread (see event_complete) */
+            if (c->state == CLIENT_HANDLING) {
+                return client_watch(efd, c) < 0;
+            }
+        }
+
+        /* Send request body to CGI script left by the handler, then relay
+         * its output */
+        if (c->connection->relay && c->connection->relay->input >= 0) {
+            c->state = CLIENT_UPLOADING;
+            return event_upload(efd, c);
+        }
+        if (c->connection->relay) {
+            c->state = CLIENT_RELAYING;
+            return event_relay(efd, c);
+        }
+
+        /* Go on with buffered requests if pending output held them back, but
+         * has been sent right away */
+        held = c->file >= 0 || c->noutput - c->nsent >= EVENT_BATCH_SIZE;
+        if (client_send(c) < 0) {
+            return true;
+        }
+    } while (held && !client_pending(c));
+
+    if (client_pending(c)) {
+        c->state = CLIENT_WRITING;
+    } else {
+        c->state = CLIENT_READING;
+        if (!c->keep_alive || c->eof) {
+            return true;
+        }
+    }
+
+    return client_watch(efd, c) < 0;
+}
+
+/**
+ * Read available request data from client.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @return  Whether or not the client is finished (and should be freed).
+ **/
+static bool event_read(int efd, Client *c) {
+    Connection *connection = c->connection;
+
+    /* Make room by discarding handled requests (unless one is being parsed) */
+    if (!c->request) {
+        connection_compact(connection);
+    }
+
+    while (connection->nbuffer < sizeof(connection->buffer)) {
+        ssize_t n = connection_fill(connection);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            debug("Unable to recv: %s", strerror(errno));
+            return true;
+        }
+
+        if (n == 0) {
+            c->eof = true;
+            break;
+        }
+    }
+
+    return event_process(efd, c);
+}
+
+/**
+ * Send pending response data to client.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @return  Whether or not the client is finished (and should be freed).
+ *
+ * Once everything is sent, any further buffered requests are handled.
+ **/
+static bool event_write(int efd, Client *c) {
+    if (client_send(c) < 0) {
+        return true;
+    }
+
+    if (client_pending(c)) {
+        return false;
+    }
+    return event_process(efd, c);
+}
+
+/**
+ * Relay available CGI output to client.
+ *
+ * @param   c           Client structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Once the script's header is complete, the response header built from it
+ * is queued (see relay_header).  Then, once everything before it has been
+ * sent, output already in the pipe is spliced straight into the client
+ * socket (with its chunk framing queued around it).  Output that cannot be
+ * spliced (the socket of a pooled worker) is read into the output buffer
+ * instead, but only once the buffer has been sent, so a script that writes
+ * faster than the client reads is held back rather than buffered here.
+ *
+ * At most EVENT_BATCH_SIZE bytes are relayed per call, so a fast script
+ * cannot starve the other clients.
+ **/
+static int client_relay(Client *c) {
+    Connection *connection = c->connection;
+    Relay      *relay      = connection->relay;
+    Request    *r          = c->request;
+    size_t      nrelayed   = 0;
+
+    c->stalled = false;
+
+    /* Queue response header once CGI header is complete */
+    if (!relay->started) {
+        Response response;
+        int status = relay_header(relay, &response);
+        if (status > 0) {
+            return 0;
+        }
+
+        if (status < 0) {
+            size_t size = 0;
+            const char *page = templates_error(HTTP_STATUS_INTERNAL_SERVER_ERROR, false, !relay->body, &size);
+            relay->keep_alive = false;
+            relay->finished   = true;
+            c->status         = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            if (page && client_stream_write(c, page, size) < 0) {
+                return -1;
+            }
+            r->nsent += size;
+        } else if (client_stream_write(c, response.data, response.length) < 0) {
+            return -1;
+        } else {
+            r->nsent += response.length;
+        }
+    }
+
+    /* Relay body */
+    while (nrelayed < EVENT_BATCH_SIZE) {
+        if (c->nsent < c->noutput) {
+            if (client_send(c) < 0) {
+                return -1;
+            }
+            if (c->nsent < c->noutput) {
+                break;
+            }
+        }
+
+        char frame[RELAY_FRAME];
+        size_t nframe;
+        ssize_t n;
+
+        if (relay->nsplice > 0) {
+            n = splice(relay->fd, NULL, connection->fd, NULL, relay->nsplice, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                /* The output is already in the pipe, so the socket is full */
+                c->stalled = true;
+                break;
+            }
+            if (n <= 0) {
+                debug("Unable to splice CGI output: %s", n < 0 ? strerror(errno) : "end of output");
+                return -1;
+            }
+
+            relay->nsplice -= n;
+            r->nsent       += n;
+            if (relay->nsplice == 0 && relay->chunked && client_stream_write(c, "\r\n", 2) < 0) {
+                return -1;
+            }
+        } else if (relay->finished) {
+            break;
+        } else if (relay_splice_start(relay, frame, &nframe) > 0) {
+            if (nframe && client_stream_write(c, frame, nframe) < 0) {
+                return -1;
+            }
+            continue;
+        } else {
+            if (client_reserve(c, EVENT_BATCH_SIZE + RELAY_FRAME) < 0) {
+                return -1;
+            }
+
+            n = relay_read(relay, c->output + c->noutput, EVENT_BATCH_SIZE + RELAY_FRAME);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n < 0) {
+                debug("Unable to read CGI output: %s", strerror(errno));
+                return -1;
+            }
+            c->noutput += n;
+            r->nsent   += n;
+        }
+        nrelayed += n;
+    }
+    return 0;
+}
+
+/**
+ * Finish relaying CGI output.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @return  Whether or not the client is finished (and should be freed).
+ *
+ * The client drains the rest of the response like any other, and then
+ * handles any further requests if the connection persists.
+ **/
+static bool event_relay_done(int efd, Client *c) {
+    Connection *connection = c->connection;
+
+    c->keep_alive = connection->relay->keep_alive;
+    client_relay_free(efd, c);
+    client_finish(c);
+    c->state      = CLIENT_WRITING;
+    return event_process(efd, c);
+}
+
+/**
+ * Relay CGI output to client.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @return  Whether or not the client is finished (and should be freed).
+ *
+ * Any pending output is sent first, and then whatever output is available
+ * is relayed (see client_relay).
+ **/
+static bool event_relay(int efd, Client *c) {
+    Relay *relay = c->connection->relay;
+
+    if (client_send(c) < 0 || client_relay(c) < 0) {
+        return true;
+    }
+
+    if (relay->finished && relay->nsplice == 0) {
+        return event_relay_done(efd, c);
+    }
+    return client_watch(efd, c) < 0;
+}
+
+/**
+ * Finish sending request body to CGI script.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @return  Whether or not the client is finished (and should be freed).
+ *
+ * The CGI input is closed (so the script sees the end of the body).  Then
+ * the rest of the script's output is relayed.
+ **/
+static bool event_upload_done(int efd, Client *c) {
+    Relay *relay = c->connection->relay;
+
+    /* Remove input from epoll before closing it (see client_relay_free) */
+    if (client_register(efd, c, relay->input, &c->input_events, 0) < 0) {
+        return true;
+    }
+    close(relay->input);
+    relay->input = -1;
+
+    c->full    = false;
+    c->state   = CLIENT_RELAYING;
+    return event_relay(efd, c);
+}
+
+/**
+ * Send available request body to CGI script, while relaying its output.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   c           Client structure.
+ * @return  Whether or not the client is finished (and should be freed).
+ *
+ * The body is read through the connection buffer and written to the CGI
+ * input piece by piece (see request_body_buffered), so only a buffer of it
+ * is ever held here: while the script's input is full, the client is not
+ * read from.
+ *
+ * Meanwhile, the script's output is relayed as it arrives (see
+ * client_relay), since a script may write output before it has read all of
+ * its input (i.e. echo the body back).  If the script finishes its output
+ * first, the rest of the body is dropped.  If the body turns out to be
+ * malformed or too large, then an error page is sent instead (unless the
+ * response has started already) and the connection closes.  If the script
+ * stops reading its input, then whatever it writes is still relayed, but the
+ * connection closes, since the rest of the body is left unread.
+ *
+ * At most EVENT_BATCH_SIZE bytes are sent per call, so a fast client cannot
+ * starve the other clients.
+ **/
+static bool event_upload(int efd, Client *c) {
+    Connection *connection = c->connection;
+    Relay      *relay      = connection->relay;
+    size_t      nuploaded  = 0;
+
+    if (client_send(c) < 0) {
+        return true;
+    }
+    c->full = false;
+
+    while (true) {
+        const char *data;
+        ssize_t n = request_body_buffered(c->request, &data);
+        if (n == 0) {
+            return event_upload_done(efd, c);
+        }
+
+        /* Only stop once the buffer is drained, so the client socket is
+         * readable whenever there is more to send */
+        if (n < 0 && errno == EAGAIN) {
+            if (nuploaded >= EVENT_BATCH_SIZE) {
+                break;
+            }
+            n = connection_fill(connection);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n <= 0) {
+                debug("Unable to read request body: %s", n < 0 ? strerror(errno) : "end of stream");
+                return true;
+            }
+            continue;
+        }
+
+        if (n < 0) {
+            size_t size = 0;
+            c->status = errno == EFBIG ? HTTP_STATUS_PAYLOAD_TOO_LARGE : HTTP_STATUS_BAD_REQUEST;
+            const char *page = templates_error(c->status, false, !relay->body, &size);
+            if (relay->started) {
+                debug("Unable to read request body: %s", strerror(errno));
+                return true;
+            }
+            client_relay_free(efd, c);
+            c->keep_alive = false;
+            if (page && client_stream_write(c, page, size) < 0) {
+                return true;
+            }
+            c->request->nsent += size;
+            client_finish(c);
+            c->state = CLIENT_WRITING;
+            return event_process(efd, c);
+        }
+
+        n = write(relay->input, data, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            c->full = true;
+            break;
+        }
+        if (n < 0) {
+            debug("Unable to send request body: %s", strerror(errno));
+            relay->keep_alive = false;
+            return event_upload_done(efd, c);
+        }
+        request_body_consume(c->request, n);
+        nuploaded += n;
+    }
+
+    /* Relay output written meanwhile; once the script is done with it, the
+     * rest of the body is of no use */
+    if (client_relay(c) < 0) {
+        return true;
+    }
+    if (relay->finished && relay->nsplice == 0) {
+        request_body_discard(c->request);
+        relay->keep_alive = relay->keep_alive && c->request->keep_alive;
+        return event_upload_done(efd, c);
+    }
+    return client_watch(efd, c) < 0;
+}
+
+/**
+ * Close clients that have been idle for longer than KeepAliveTimeout.
+ *
+ * @param   efd         Epoll file descriptor.
+ *
+ * Only clients that are waiting for the client itself are closed.  Those
+ * waiting for a CGI script (relaying its output, or sending it a body it has
+ * no room for yet) or for a helper thread are given another timeout instead,
+ * just like the blocking modes never time out a script.
+ **/
+static void event_sweep(int efd) {
+    time_t now = time(NULL);
+    while (IdleHead && IdleHead->deadline <= now) {
+        Client *c = IdleHead;
+        bool waiting = c->state == CLIENT_HANDLING ||
+                       (c->state == CLIENT_RELAYING && !client_pending(c) && !c->stalled) ||
+                       (c->state == CLIENT_UPLOADING && c->full);
+
+        if (waiting) {
+            client_touch(c);
+            continue;
+        }
+
+        debug("Closing idle connection from %s:%s", c->connection->host, c->connection->port);
+        client_free(efd, c);
+    }
+}
+
+/**
+ * Handle requests deferred by the loop (helper thread).
+ *
+ * @param   arg         Unused.
+ * @return  NULL.
+ *
+ * The helper resumes each deferred request where the handler left it (see
+ * handle_defer), writing its response into the client output buffer (and
+ * sending it, if it grows too large), while the loop leaves the client
+ * alone.  Then the client is handed back to the loop (see event_complete).
+ **/
+static void * event_helper(void *arg) {
+    uint64_t one = 1;
+
+    while (true) {
+        pthread_mutex_lock(&Lock);
+        while (!Deferred) {
+            pthread_cond_wait(&Ready, &Lock);
+        }
+        Client *c = Deferred;
+        if (!(Deferred = c->queued)) {
+            LastDeferred = NULL;
+        }
+        pthread_mutex_unlock(&Lock);
+
+        c->connection->deferrable = false;
+        c->status = handle_request(c->request);
+
+        pthread_mutex_lock(&Lock);
+        c->queued = Handled;
+        Handled   = c;
+        pthread_mutex_unlock(&Lock);
+
+        if (write(Notify, &one, sizeof(one)) < 0) {
+            debug("Unable to notify loop: %s", strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Resume clients whose requests the helper threads are done with.
+ *
+ * @param   efd         Epoll file descriptor.
+ **/
+static void event_complete(int efd) {
+    uint64_t count;
+    if (read(Notify, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        debug("Unable to read notification: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&Lock);
+    Client *c = Handled;
+    Handled = NULL;
+    pthread_mutex_unlock(&Lock);
+
+    while (c) {
+        Client *next = c->queued;
+
+        c->state = CLIENT_READING;
+        if (event_handled(c) < 0 || event_process(efd, c)) {
+            client_free(efd, c);
+        } else {
+            client_touch(c);
+        }
+        c = next;
+    }
+}
+
+/**
+ * Multiplex HTTP connections with a single epoll event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Client sockets are non-blocking: each request header is buffered as it
+ * arrives and the request is only handled once the header is complete.  Any
+ * response data the socket cannot immediately accept is buffered and sent
+ * when the socket becomes writable, so a slow client never stalls the loop.
+ *
+ * Request bodies are sent to CGI scripts and their output is relayed by the
+ * loop as well (see event_upload and event_relay), and scripts are reaped
+ * automatically, so a slow script only holds up its own client.
+ *
+ * Work that may block (see handle_defer) is done by Workers (but at least
+ * EVENT_HELPERS) helper threads instead, so it only holds up its own client
+ * as well.
+ *
+ * Clients without any activity for KeepAliveTimeout seconds are closed.
+ **/
+int event_server(int sfd) {
+    log("Entered Event Server");
+
+    if (socket_nonblocking(sfd, true) < 0) {
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    /* Reap CGI scripts automatically (their output is relayed by the loop) */
+    signal(SIGCHLD, SIG_IGN);
+
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    if (efd < 0) {
+        log("Unable to create epoll: %s", strerror(errno));
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    /* Server socket is registered with a NULL client */
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &event) < 0) {
+        log("Unable to add server socket: %s", strerror(errno));
+        goto done;
+    }
+
+    /* Start helper threads, which signal the loop through Notify */
+    Notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event.data.ptr = &Notify;
+    if (Notify < 0 || epoll_ctl(efd, EPOLL_CTL_ADD, Notify, &event) < 0) {
+        log("Unable to add notification: %s", strerror(errno));
+        goto done;
+    }
+
+    for (int i = 0; i < Workers || i < EVENT_HELPERS; i++) {
+        pthread_t thread;
+        int status = pthread_create(&thread, NULL, event_helper, NULL);
+        if (status != 0) {
+            log("Unable to create helper: %s", strerror(status));
+            goto done;
+        }
+        pthread_detach(thread);
+    }
+
+    /* Dispatch events */
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    while (true) {
+        int timeout = (KeepAliveTimeout > 0 && IdleHead) ? EVENT_SWEEP_MS : -1;
+        int nevents = epoll_wait(efd, events, EVENT_MAX_EVENTS, timeout);
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log("Unable to wait for events: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            Client *c = events[i].data.ptr;
+            if (!c) {
+                event_accept(efd, sfd);
+                continue;
+            }
+            if (events[i].data.ptr == &Notify) {
+                event_complete(efd);
+                continue;
+            }
+            if (!c->connection || c->state == CLIENT_HANDLING) {
+                continue;
+            }
+
+            bool finished;
+            if (c->state == CLIENT_READING) {
+                finished = event_read(efd, c);
+            } else if (c->state == CLIENT_UPLOADING) {
+                finished = event_upload(efd, c);
+            } else if (c->state == CLIENT_RELAYING) {
+                finished = event_relay(efd, c);
+            } else {
+                finished = event_write(efd, c);
+            }
+
+            if (finished) {
+                client_free(efd, c);
+            } else {
+                client_touch(c);
+            }
+        }
+
+        if (KeepAliveTimeout > 0) {
+            event_sweep(efd);
+        }
+        client_collect();
+    }
+
+done:
+    /* Close epoll and server socket */
+    close(efd);
+    close(sfd);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
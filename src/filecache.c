@@ -0,0 +1,328 @@
+/* filecache.c: In-Memory File Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define FILECACHE_BUCKETS   1024        /* Number of hash table buckets */
+
+/* Global Variables */
+
+static CachedFile     *Buckets[FILECACHE_BUCKETS];  /* Entries by file */
+static CachedFile     *LRUHead = NULL;              /* Most recently used */
+static CachedFile     *LRUTail = NULL;              /* Least recently used */
+static size_t          Used    = 0;                 /* Bytes held by entries */
+static pthread_mutex_t Lock    = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Deallocate entry.
+ *
+ * @param   f           CachedFile structure.
+ **/
+static void filecache_free(CachedFile *f) {
+    free(f->variant);
+    free(f->data);
+    free(f);
+}
+
+/**
+ * Determine hash bucket of file and variant.
+ *
+ * @param   dev         Device of file.
+ * @param   ino         Inode of file.
+ * @param   variant     Variant of response.
+ * @return  Hash table bucket.
+ **/
+static CachedFile ** filecache_bucket(dev_t dev, ino_t ino, const char *variant) {
+    return &Buckets[(hash_string(variant) ^ ino ^ dev) % FILECACHE_BUCKETS];
+}
+
+/**
+ * Remove entry from hash table and LRU list (Lock must be held).
+ *
+ * @param   f           CachedFile structure.
+ *
+ * The entry itself is freed once the last reference is released.
+ **/
+static void filecache_unlink(CachedFile *f) {
+    CachedFile **p = filecache_bucket(f->dev, f->ino, f->variant);
+    while (*p != f) {
+        p = &(*p)->chain;
+    }
+    *p = f->chain;
+
+    if (f->prev) f->prev->next = f->next; else LRUHead = f->next;
+    if (f->next) f->next->prev = f->prev; else LRUTail = f->prev;
+
+    Used -= f->ndata;
+    if (--f->references == 0) {
+        filecache_free(f);
+    }
+}
+
+/**
+ * Move entry to front of LRU list (Lock must be held).
+ *
+ * @param   f           CachedFile structure.
+ **/
+static void filecache_touch(CachedFile *f) {
+    if (f == LRUHead) {
+        return;
+    }
+
+    f->prev->next = f->next;
+    if (f->next) f->next->prev = f->prev; else LRUTail = f->prev;
+
+    f->prev = NULL;
+    f->next = LRUHead;
+    LRUHead->prev = f;
+    LRUHead = f;
+}
+
+/**
+ * Determine if entry still matches file on disk.
+ *
+ * @param   f           CachedFile structure.
+ * @param   sb          Current stat of file.
+ * @return  Whether or not the cached contents are current.
+ **/
+static bool filecache_current(CachedFile *f, struct stat *sb) {
+    return f->size == sb->st_size &&
+           f->mtime.tv_sec == sb->st_mtim.tv_sec && f->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+/**
+ * Determine if entry is for the specified file and variant.
+ *
+ * @param   f           CachedFile structure.
+ * @param   dev         Device of file.
+ * @param   ino         Inode of file.
+ * @param   variant     Variant of response.
+ * @return  Whether or not the entry matches.
+ **/
+static bool filecache_matches(CachedFile *f, dev_t dev, ino_t ino, const char *variant) {
+    return f->dev == dev && f->ino == ino && streq(f->variant, variant);
+}
+
+/**
+ * Lookup cached file.
+ *
+ * @param   sb          Current stat of file (or directory).
+ * @param   variant     Variant of response generated from the file (NULL for
+ * its plain contents).
+ * @return  Referenced CachedFile structure (or NULL if not cached).
+ *
+ * Entries are keyed by device and inode, so every path leading to the same
+ * file shares them.  If the size or modification time in sb differs from
+ * when the entry was cached, then the entry is dropped.
+ *
+ * The returned entry must be released with filecache_release.
+ **/
+CachedFile * filecache_lookup(struct stat *sb, const char *variant) {
+    CachedFile *f;
+
+    if (FileCacheBudget == 0) {
+        return NULL;
+    }
+    variant = variant ? variant : "";
+
+    pthread_mutex_lock(&Lock);
+    for (f = *filecache_bucket(sb->st_dev, sb->st_ino, variant); f; f = f->chain) {
+        if (filecache_matches(f, sb->st_dev, sb->st_ino, variant)) {
+            break;
+        }
+    }
+
+    if (f && !filecache_current(f, sb)) {
+        debug("Invalidating cached inode %ju", (uintmax_t)sb->st_ino);
+        filecache_unlink(f);
+        f = NULL;
+    }
+
+    if (f) {
+        filecache_touch(f);
+        f->references++;
+    }
+    pthread_mutex_unlock(&Lock);
+    return f;
+}
+
+/**
+ * Determine whether entry of size would be cached.
+ *
+ * @param   size        Length of header and body.
+ * @return  Whether the entry fits (entries larger than an eighth of
+ * FileCacheBudget are not cached).
+ **/
+bool filecache_fits(size_t size) {
+    return FileCacheBudget > 0 && size <= FileCacheBudget / 8;
+}
+
+/**
+ * Allocate entry with room for header and body.
+ *
+ * @param   sb          Stat of file.
+ * @param   variant     Variant of response (NULL for plain contents).
+ * @param   header      Response header block to store before the body.
+ * @param   nbody       Length of body.
+ * @return  Newly allocated CachedFile structure (or NULL if it does not fit).
+ **/
+static CachedFile * filecache_allocate(struct stat *sb, const char *variant, const char *header, size_t nbody) {
+    size_t nheader = strlen(header);
+    size_t ndata   = nheader + nbody;
+
+    if (!filecache_fits(ndata)) {
+        return NULL;
+    }
+
+    CachedFile *f = calloc(1, sizeof(CachedFile));
+    if (!f || !(f->variant = strdup(variant ? variant : "")) || !(f->data = malloc(ndata))) {
+        debug("Unable to allocate cached file: %s", strerror(errno));
+        if (f) {
+            filecache_free(f);
+        }
+        return NULL;
+    }
+
+    f->dev        = sb->st_dev;
+    f->ino        = sb->st_ino;
+    f->size       = sb->st_size;
+    f->mtime      = sb->st_mtim;
+    f->nheader    = nheader;
+    f->ndata      = ndata;
+    f->references = 2;          /* Cache and caller */
+    memcpy(f->data, header, nheader);
+    return f;
+}
+
+/**
+ * Add entry to cache.
+ *
+ * @param   f           CachedFile structure.
+ * @return  Referenced CachedFile structure.
+ *
+ * Any entry for the same file and variant (i.e. one added concurrently) is
+ * replaced, and least recently used entries are evicted until the new entry
+ * fits in the budget.
+ **/
+static CachedFile * filecache_add(CachedFile *f) {
+    pthread_mutex_lock(&Lock);
+
+    CachedFile **bucket = filecache_bucket(f->dev, f->ino, f->variant);
+    for (CachedFile *g = *bucket; g; g = g->chain) {
+        if (filecache_matches(g, f->dev, f->ino, f->variant)) {
+            filecache_unlink(g);
+            break;
+        }
+    }
+
+    while (LRUTail && Used + f->ndata > FileCacheBudget) {
+        debug("Evicting cached inode %ju", (uintmax_t)LRUTail->ino);
+        filecache_unlink(LRUTail);
+    }
+
+    f->chain = *bucket;
+    *bucket  = f;
+    f->next  = LRUHead;
+    if (LRUHead) LRUHead->prev = f; else LRUTail = f;
+    LRUHead  = f;
+    Used    += f->ndata;
+
+    pthread_mutex_unlock(&Lock);
+    return f;
+}
+
+/**
+ * Read file into cache.
+ *
+ * @param   fd          Open file descriptor of file.
+ * @param   sb          Stat of opened file.
+ * @param   variant     Variant of response (NULL for plain contents).
+ * @param   header      Response header block to store before the contents.
+ * @return  Referenced CachedFile structure (or NULL if the file is not cached).
+ *
+ * A variant lets the contents of a file be cached with a header that is only
+ * right for some requests (i.e. a precompressed sidecar sent with a
+ * Content-Encoding).
+ *
+ * The returned entry must be released with filecache_release.
+ **/
+CachedFile * filecache_insert(int fd, struct stat *sb, const char *variant, const char *header) {
+    CachedFile *f = filecache_allocate(sb, variant, header, sb->st_size);
+    if (!f) {
+        return NULL;
+    }
+
+    /* Read contents (giving up if the file changes size underneath us) */
+    for (size_t n = f->nheader; n < f->ndata; ) {
+        ssize_t nread = pread(fd, f->data + n, f->ndata - n, n - f->nheader);
+        if (nread <= 0) {
+            debug("Unable to read file: %s", strerror(errno));
+            filecache_free(f);
+            return NULL;
+        }
+        n += nread;
+    }
+
+    return filecache_add(f);
+}
+
+/**
+ * Add response generated from file (or directory) to cache.
+ *
+ * @param   sb          Stat of file taken before the response was generated.
+ * @param   variant     Variant of response.
+ * @param   header      Response header block to store before the body.
+ * @param   body        Response body.
+ * @param   nbody       Length of body.
+ * @return  Referenced CachedFile structure (or NULL if it is not cached).
+ *
+ * The returned entry must be released with filecache_release.
+ **/
+CachedFile * filecache_insert_variant(struct stat *sb, const char *variant, const char *header, const char *body, size_t nbody) {
+    CachedFile *f = filecache_allocate(sb, variant, header, nbody);
+    if (!f) {
+        return NULL;
+    }
+
+    memcpy(f->data + f->nheader, body, nbody);
+    return filecache_add(f);
+}
+
+/**
+ * Release reference to cached file.
+ *
+ * @param   f           CachedFile structure.
+ **/
+void filecache_release(CachedFile *f) {
+    pthread_mutex_lock(&Lock);
+    if (--f->references == 0) {
+        filecache_free(f);
+    }
+    pthread_mutex_unlock(&Lock);
+}
+
+/**
+ * Drop every entry.
+ *
+ * Entries still referenced are freed once released, just like invalidated
+ * ones.  This is used when something baked into the cached headers (such as
+ * the mimetype table) changes.
+ **/
+void filecache_flush(void) {
+    pthread_mutex_lock(&Lock);
+    while (LRUHead) {
+        filecache_unlink(LRUHead);
+    }
+    pthread_mutex_unlock(&Lock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -9,41 +9,45 @@
 #include <unistd.h>
 
 /**
- * Fork incoming HTTP requests to handle the concurrently.
+ * Fork incoming HTTP connections to handle them concurrently.
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
- * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * The parent should accept a connection and then fork off and let the child
+ * handle the requests on the connection.
  **/
 int forking_server(int sfd) {
-    /* Accept and handle HTTP request */
+    /* Accept and handle HTTP connection */
     log("Entered Forking Server");
     while (true) {
-    	/* Accept request */
-        Request *request = accept_request(sfd);
-        if ( !request ) {
-            log("Unable to accept request: %s", strerror(errno));
+    	/* Accept connection */
+        Connection *connection = accept_connection(sfd);
+        if ( !connection ) {
+            log("Unable to accept connection: %s", strerror(errno));
             continue;
         }
 
 	/* Ignore children */
         signal(SIGCHLD, SIG_IGN);
 
-	/* Fork off child process to handle request */
+	/* Apply pending mimetypes reload before the child inherits the table */
+        mimetypes_refresh();
+
+	/* Fork off child process to handle connection */
         pid_t pid = fork();
         if (pid < 0) {
             log("Unsuccesful fork: %s", strerror(errno));
+            free_connection(connection);
             continue;
         }
         if (pid == 0) {
-            handle_request(request);
-            free_request(request);
-            debug("Child handled the request");
+            handle_connection(connection);
+            free_connection(connection);
+            debug("Child handled the connection");
             exit(EXIT_SUCCESS);
         } else {
-            free_request(request);
+            free_connection(connection);
         }
     }
 
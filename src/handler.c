@@ -2,82 +2,475 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define RANGE_MAX   16                  /* Most byte ranges served at once */
+#define IDLE_WAIT   500                 /* Longest wait (ms) for next request on idle connection */
+
+/**
+ * Byte range of file (inclusive)
+ */
+typedef struct {
+    off_t       first;                  /*< Offset of first byte */
+    off_t       last;                   /*< Offset of last byte */
+} Range;
+
 /* Internal Declarations */
-Status handle_browse_request(Request *request);
-Status handle_file_request(Request *request);
-Status handle_cgi_request(Request *request);
+Status handle_browse_request(Request *request, struct stat *sb);
+Status handle_file_request(Request *request, struct stat *sb);
+Status handle_cgi_request(Request *request, struct stat *sb);
 Status handle_error(Request *request, Status status);
 
+/* Global Variables */
+
+static const struct {
+    HeaderName  header;
+    const char *variable;
+} CGIHeaders[] = {                      /* Request headers passed to CGI scripts */
+    {HEADER_ACCEPT,             "HTTP_ACCEPT"},
+    {HEADER_ACCEPT_ENCODING,    "HTTP_ACCEPT_ENCODING"},
+    {HEADER_ACCEPT_LANGUAGE,    "HTTP_ACCEPT_LANGUAGE"},
+    {HEADER_CONNECTION,         "HTTP_CONNECTION"},
+    {HEADER_CONTENT_TYPE,       "CONTENT_TYPE"},
+    {HEADER_HOST,               "HTTP_HOST"},
+    {HEADER_USER_AGENT,         "HTTP_USER_AGENT"},
+};
+
+static const size_t NCGIHeaders = sizeof(CGIHeaders) / sizeof(CGIHeaders[0]);
+
+/**
+ * Handle HTTP Connection.
+ *
+ * @param   c           HTTP Connection structure.
+ *
+ * This handles requests on the connection until the client or a response
+ * asks for the connection to be closed, the client closes its end, or no new
+ * request arrives in time.
+ *
+ * The caller's worker is tied up for as long as the connection is open, so
+ * once a response has been sent the next request is only awaited for
+ * IDLE_WAIT milliseconds (rather than KeepAliveTimeout seconds, which still
+ * bounds how long each request takes to arrive).
+ **/
+void handle_connection(Connection *c) {
+    bool keep_alive = true;
+    int  idle_wait  = KeepAliveTimeout * 1000 < IDLE_WAIT ? KeepAliveTimeout * 1000 : IDLE_WAIT;
+
+    for (size_t nrequests = 0; keep_alive; nrequests++) {
+        /* Start next request, then wait for it (or end of stream or idle
+         * timeout) unless it was pipelined behind the previous one */
+        Request *r = create_request(c);
+        if (!r) {
+            break;
+        }
+
+        struct pollfd pfd = {c->fd, POLLIN, 0};
+        if (!connection_pending(c) && ((nrequests && poll(&pfd, 1, idle_wait) <= 0) || connection_fill(c) <= 0)) {
+            debug("Connection closed or idle: %s", strerror(errno));
+            free_request(r);
+            break;
+        }
+
+        /* Handle request */
+        handle_request(r);
+        keep_alive = r->keep_alive;
+        free_request(r);
+
+        /* Batch responses to pipelined requests: only send once no further
+         * request is buffered */
+        if (!connection_pending(c) && fflush(c->stream) != 0) {
+            break;
+        }
+    }
+}
+
+/**
+ * Start response header for body of known length.
+ *
+ * @param   response    Response structure.
+ * @param   status      HTTP status of response.
+ * @param   mimetype    Content-Type of response body.
+ * @param   length      Content-Length of response body.
+ *
+ * The Connection field is left off until the response is sent (see
+ * response_send), since it depends on the request, so that the rest of the
+ * header can be cached.
+ **/
+static void start_response(Response *response, Status status, const char *mimetype, off_t length) {
+    response_start(response, status);
+    response_field(response, "Content-Type", "%s", mimetype);
+    response_field(response, "Content-Length", "%jd", (intmax_t)length);
+}
+
+/**
+ * Send cached file (header and contents) and release it.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   f           Referenced CachedFile structure.
+ * @return  Status of the HTTP file request.
+ **/
+static Status send_cached_file(Request *r, CachedFile *f) {
+    const char *connection = r->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    struct iovec iov[] = {
+        {f->data, f->nheader},
+        {(char *)connection, strlen(connection)},
+        {f->data + f->nheader, f->ndata - f->nheader},
+    };
+
+    int status = response_write(r, iov, r->head ? 2 : 3);
+    filecache_release(f);
+
+    if (status < 0) {
+        r->keep_alive = false;
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Format entity tag of file.
+ *
+ * @param   buffer      Buffer to format tag into.
+ * @param   size        Size of buffer.
+ * @param   sb          Stat of file.
+ * @param   coding      Content coding of response (NULL for identity).
+ *
+ * The tag (a quoted string) is derived from the inode, size, and modification
+ * time of the file, so it changes whenever the file is replaced or modified.
+ * Encoded responses get the coding appended, since they are different
+ * representations of the file.
+ **/
+static void format_etag(char *buffer, size_t size, struct stat *sb, const char *coding) {
+    snprintf(buffer, size, "\"%jx-%jx-%jx%s%s\"", (uintmax_t)sb->st_ino, (uintmax_t)sb->st_size,
+        (uintmax_t)sb->st_mtim.tv_sec * 1000000000u + sb->st_mtim.tv_nsec,
+        coding ? "-" : "", coding ? coding : "");
+}
+
+/**
+ * Format time as HTTP date (RFC 7231 IMF-fixdate).
+ *
+ * @param   buffer      Buffer to format date into.
+ * @param   size        Size of buffer.
+ * @param   t           Time to format.
+ **/
+static void format_http_date(char *buffer, size_t size, time_t t) {
+    struct tm tm;
+    strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+/**
+ * Parse HTTP date (RFC 7231 IMF-fixdate).
+ *
+ * @param   s           HTTP date.
+ * @return  Parsed time (or -1 if it is malformed).
+ **/
+static time_t parse_http_date(const char *s) {
+    struct tm tm = {0};
+    const char *end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return end && *skip_whitespace((char *)end) == '\0' ? timegm(&tm) : -1;
+}
+
+/**
+ * Determine whether response for file depends on Accept-Encoding.
+ *
+ * @param   sb          Stat of file.
+ * @param   mimetype    Mimetype of file.
+ * @return  Whether an encoded representation may be sent.
+ *
+ * Only files of a compressible mimetype that are at least CompressMinSize
+ * bytes are negotiated, since compressing tiny files saves next to nothing.
+ **/
+static bool encoding_negotiable(struct stat *sb, const char *mimetype) {
+    return CompressMinSize >= 0 && sb->st_size >= CompressMinSize && compress_mimetype(mimetype);
+}
+
+/**
+ * Append validator and caching header fields of file to response.
+ *
+ * @param   response    Response structure.
+ * @param   sb          Stat of file.
+ * @param   mimetype    Mimetype of file.
+ * @param   coding      Content coding of response (NULL for identity).
+ *
+ * This formats the ETag and Last-Modified fields clients revalidate with, the
+ * Cache-Control field configured for the mimetype (if any), and a Vary field
+ * if the file is negotiated (so shared caches keep each encoding apart).
+ **/
+static void add_cache_fields(Response *response, struct stat *sb, const char *mimetype, const char *coding) {
+    const char *directives = determine_cache_control(mimetype);
+    char etag[64];
+    char date[64];
+
+    format_etag(etag, sizeof(etag), sb, coding);
+    format_http_date(date, sizeof(date), sb->st_mtim.tv_sec);
+
+    response_field(response, "ETag", "%s", etag);
+    response_field(response, "Last-Modified", "%s", date);
+    if (encoding_negotiable(sb, mimetype)) {
+        response_field(response, "Vary", "Accept-Encoding");
+    }
+    if (directives) {
+        response_field(response, "Cache-Control", "%s", directives);
+    }
+}
+
+/**
+ * Check whether list of entity tags contains tag (weak comparison).
+ *
+ * @param   list        Data of If-None-Match header.
+ * @param   etag        Entity tag of file.
+ * @return  Whether any tag in list (or *) matches.
+ **/
+static bool etag_matches(const char *list, const char *etag) {
+    size_t n = strlen(etag);
+
+    for (const char *s = list; *s; ) {
+        while (*s == ' ' || *s == '\t' || *s == ',') {
+            s++;
+        }
+        if (*s == '*') {
+            return true;
+        }
+        if (strncmp(s, "W/", 2) == 0) {
+            s += 2;
+        }
+        if (strncmp(s, etag, n) == 0 && (s[n] == '\0' || s[n] == ',' || s[n] == ' ' || s[n] == '\t')) {
+            return true;
+        }
+
+        /* Skip tag (which may contain commas) */
+        if (*s == '"') {
+            const char *quote = strchr(s + 1, '"');
+            s = quote ? quote + 1 : s + strlen(s);
+        }
+        while (*s && *s != ',') {
+            s++;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check whether client already has current copy of file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of file.
+ * @param   coding      Content coding of response (NULL for identity).
+ * @return  Whether a 304 Not Modified response should be sent.
+ *
+ * If-None-Match takes precedence over If-Modified-Since, as RFC 7232
+ * requires.  Only GET and HEAD requests are answered with 304.
+ **/
+static bool request_not_modified(Request *r, struct stat *sb, const char *coding) {
+    const char *match = request_header(r, HEADER_IF_NONE_MATCH);
+    const char *since = request_header(r, HEADER_IF_MODIFIED_SINCE);
+    const char *method;
+
+    if (!match && !since) {
+        return false;
+    }
+
+    method = request_string(r, r->method);
+    if (!streq(method, "GET") && !streq(method, "HEAD")) {
+        return false;
+    }
+
+    if (match) {
+        char etag[64];
+        format_etag(etag, sizeof(etag), sb, coding);
+        return etag_matches(match, etag);
+    }
+
+    time_t t = parse_http_date(since);
+    return t >= 0 && sb->st_mtim.tv_sec <= t;
+}
+
+/**
+ * Check whether Range header applies to current copy of file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of file.
+ * @return  Whether the If-Range validator (if any) matches the file.
+ *
+ * If-Range holds either an entity tag, which must match exactly (strong
+ * comparison), or a date, which must equal the Last-Modified date.
+ * Otherwise, the client's copy is stale and the whole file must be sent.
+ **/
+static bool request_range_applies(Request *r, struct stat *sb) {
+    const char *validator = request_header(r, HEADER_IF_RANGE);
+
+    if (!validator) {
+        return true;
+    }
+
+    if (validator[0] == '"') {
+        char etag[64];
+        format_etag(etag, sizeof(etag), sb, NULL);
+        return streq(validator, etag);
+    }
+
+    return parse_http_date(validator) == sb->st_mtim.tv_sec;
+}
+
+/**
+ * Handle revalidation of current file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of file.
+ * @param   mimetype    Mimetype of file.
+ * @param   coding      Content coding of response (NULL for identity).
+ * @return  Status of the HTTP file request.
+ *
+ * The response is just a header with the validators (and Cache-Control) of
+ * the file, so the connection can persist.
+ **/
+static Status handle_not_modified(Request *r, struct stat *sb, const char *mimetype, const char *coding) {
+    Response response;
+
+    response_start(&response, HTTP_STATUS_NOT_MODIFIED);
+    add_cache_fields(&response, sb, mimetype, coding);
+    if (response_send(r, &response, NULL, 0) < 0) {
+        r->keep_alive = false;
+    }
+    return HTTP_STATUS_NOT_MODIFIED;
+}
+
+/**
+ * Leave rest of request to a helper thread of the event loop.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether the request was deferred (and the handler must return
+ * right away).
+ *
+ * Handlers call this before work that may block the event loop: scanning a
+ * directory, reading a file into the cache, compressing a file, and
+ * connecting to a CGI pool.  Nothing must have been sent yet, since the
+ * loop then hands the request to a helper thread, which calls
+ * handle_request again to resume it at the dispatch (see event.c).
+ **/
+static bool handle_defer(Request *r) {
+    if (!r->connection->deferrable) {
+        return false;
+    }
+
+    r->deferred = true;
+    return true;
+}
+
 /**
  * Handle HTTP Request.
  *
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
+ * This parses a request, opens the requested file, determines the request
  * type, and then dispatches to the appropriate handler type.
  *
+ * The file is resolved and opened once (see open_request_path), and the
+ * handlers work with that file descriptor and its stat.  Regular files with
+ * any execute bit set are treated as CGI scripts.  Only CGI scripts read the
+ * request body; other handlers discard it.
+ *
  * On error, handle_error should be used with an appropriate HTTP status code.
+ *
+ * Requests deferred by a handler (see handle_defer) are resumed at the
+ * dispatch with the file that is already open.
+ *
+ * Every handled request is recorded in the access log, once its response
+ * has been written.  The event loop sends the body of an uncached file or
+ * relays CGI output after the handler returns, so it records those requests
+ * itself once it is done (see event.c).
  **/
 Status  handle_request(Request *r) {
 
-    log("entered handle_request");
+    debug("entered handle_request");
 
     Status result;
     struct stat sb;
 
-    /* Parse request */
-    if (parse_request(r) < 0){
-        result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
-        log("HTTP REQUEST STATUS: %s\n", http_status_string(result));
-        return result;
+    if (r->deferred) {
+        r->deferred = false;
+        if (fstat(r->fd, &sb) < 0) {
+            result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+            goto done;
+        }
+        goto dispatch;
     }
 
-    /* Determine request path */
-    r->path = determine_request_path(r->uri);
+    clock_gettime(CLOCK_MONOTONIC, &r->started);
 
-    if(!r->path){
-      result = handle_error(r, HTTP_STATUS_NOT_FOUND);
-      return result;
+    /* Parse request (the rest of a malformed request cannot be skipped, so
+     * the connection must close) */
+    if (parse_request(r) < 0){
+        r->keep_alive = false;
+        result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        goto done;
     }
 
-    debug("HTTP REQUEST PATH: %s", r->path);
+    /* Refuse body larger than MaxBodySize before any of it is read (chunked
+     * bodies are checked as they are read) */
+    if (r->nbody > MaxBodySize) {
+        result = handle_error(r, HTTP_STATUS_PAYLOAD_TOO_LARGE);
+        goto done;
+    }
 
-    if(stat(r->path, &sb) < 0){
+    /* Open file (or directory) beneath RootPath */
+    const char *uri = request_string(r, r->uri);
+    r->path = arena_printf(&r->connection->arena, "%s%s", RootPath, uri);
+    r->fd   = open_request_path(uri);
+    if (!r->path || r->fd < 0 || fstat(r->fd, &sb) < 0) {
         result = handle_error(r, HTTP_STATUS_NOT_FOUND);
-        debug("HTTP REQUEST STATUS: %s\n", http_status_string(result));
-        return result;
+        goto done;
     }
 
-    /* Dispatch to appropriate request handler type based on file type */
+    debug("HTTP REQUEST PATH: %s", r->path);
 
+    /* Dispatch to appropriate request handler type based on file type */
+dispatch:
     if ( S_ISDIR(sb.st_mode) ) {
-        log("HTTP REQUEST TYPE: BROWSE");
-        result = handle_browse_request(r);
+        debug("HTTP REQUEST TYPE: BROWSE");
+        request_body_discard(r);
+        result = handle_browse_request(r, &sb);
     }
     else if(S_ISREG(sb.st_mode)) {
-        if ( !access(r->path, X_OK) ) {
-            log("HTTP REQUEST TYPE: CGI");
-            result = handle_cgi_request(r);
-        } else if ( !access(r->path, R_OK) ) {
-            log("HTTP REQUEST TYPE: FILE");
-            result = handle_file_request(r);
+        if ( sb.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH) ) {
+            debug("HTTP REQUEST TYPE: CGI");
+            result = handle_cgi_request(r, &sb);
         } else {
-            result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+            debug("HTTP REQUEST TYPE: FILE");
+            request_body_discard(r);
+            result = handle_file_request(r, &sb);
         }
     } else {
         result = handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
-    log("HTTP REQUEST STATUS: %s\n", http_status_string(result));
+done:
+    if (r->deferred) {
+        return result;
+    }
+
+    debug("HTTP REQUEST STATUS: %s", http_status_string(result));
+    if (!r->connection->relay && r->connection->file < 0) {
+        accesslog_request(r, result);
+    }
     return result;
 }
 
@@ -85,206 +478,1077 @@ Status  handle_request(Request *r) {
  * Handle browse request.
  *
  * @param   r           HTTP Request structure.
+ * @param   sb          Stat of the opened directory.
  * @return  Status of the HTTP browse request.
  *
  * This lists the contents of a directory in HTML.
  *
+ * The rendered listing is kept in the file cache (as a variant of the
+ * directory for the requested URI, since the links depend on it), so the
+ * directory is only scanned again once it changes.
+ *
  * If the path cannot be opened or scanned as a directory, then handle error
  * with HTTP_STATUS_NOT_FOUND.
  **/
-Status  handle_browse_request(Request *r) {
-    log("entered handle_browse_request");
+Status  handle_browse_request(Request *r, struct stat *sb) {
+    debug("entered handle_browse_request");
     struct dirent **entries;
     int numHeader;
+    CachedFile *f;
+    Response response;
+    char *body = NULL;
+    size_t nbody = 0;
 
-    /* Open a directory for reading or scanning */
-    numHeader = scandir(r->path, &entries, NULL, alphasort);
-    if(numHeader < 0){
-        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    /* Serve from file cache */
+    const char *uri = request_string(r, r->uri);
+    if ( (f = filecache_lookup(sb, uri)) ) {
+        return send_cached_file(r, f);
     }
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
+    if (handle_defer(r)) {
+        return HTTP_STATUS_OK;
+    }
 
-    FILE *fhtml = fopen("www/main.html","r");
-    size_t nread;
-    char buffer[BUFSIZ];
-    if( !fhtml ){
-      fprintf(stderr, "fopen failed: %s\n", strerror(errno));
-      log("fopen failed");
-      return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    /* Scan the opened directory (sb was taken before, so any change made
+     * while scanning invalidates the listing) */
+    if ((numHeader = scandirat(r->fd, ".", &entries, NULL, alphasort)) < 0) {
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
-    nread = fread(buffer, 1, BUFSIZ, fhtml);
-    while ( nread > 0 ) {
-        if ( ! fwrite(buffer, 1, nread, r->stream) ) {
-            fclose(fhtml);
-            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+
+    /* Render listing */
+    FILE *listing = open_memstream(&body, &nbody);
+    if ( !listing ) {
+        for (int i = 0; i < numHeader; i++) {
+            free(entries[i]);
         }
-        nread = fread(buffer, 1, BUFSIZ, fhtml);
+        free(entries);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    fclose(fhtml);
 
+    size_t size;
+    const char *page = templates_main(&size);
+    fwrite(page, 1, size, listing);
 
-    fprintf(r->stream, "<div class=\"btn-group-vertical d-flex\" role=\"group\">\n");
+    fprintf(listing, "<div class=\"btn-group-vertical d-flex\" role=\"group\">\n");
     for(int i = 0; i < numHeader; i++) {
         if( streq(entries[i]->d_name, ".")|| streq(entries[i]->d_name, "main.html") || streq(entries[i]->d_name, "error.html")){
             free(entries[i]);
             continue;
         }
-        fprintf(r->stream,"<a href=\"%s/%s\" class=\"btn btn-info\" role=\"button\">%s</a>\n",
-        streq(r->uri, "/") ? "" : r->uri, entries[i]->d_name, entries[i]->d_name);
+        fprintf(listing,"<a href=\"%s/%s\" class=\"btn btn-info\" role=\"button\">%s</a>\n",
+        streq(uri, "/") ? "" : uri, entries[i]->d_name, entries[i]->d_name);
         free(entries[i]);
     }
-    fprintf(r->stream, "</div>\n");
+    fprintf(listing, "</div>\n");
     free(entries);
 
+    if (fclose(listing) != 0) {
+        free(body);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Cache listing with its response header, if it fits */
+    start_response(&response, HTTP_STATUS_OK, "text/html", nbody);
+    if ( (f = filecache_insert_variant(sb, uri, response.data, body, nbody)) ) {
+        free(body);
+        return send_cached_file(r, f);
+    }
+
+    /* Write HTTP Header with OK Status and text/html Content-Type, and listing */
+    struct iovec iov = {body, nbody};
+    int result = response_send(r, &response, &iov, 1);
+    free(body);
+
+    if (result < 0) {
+        r->keep_alive = false;
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
     /* Return OK */
     return HTTP_STATUS_OK;
 }
 
 /**
- * Handle file request.
+ * Copy part of file to response stream.
+ *
+ * @param   fd          File descriptor of file.
+ * @param   stream      Response stream.
+ * @param   offset      Offset of first byte to copy.
+ * @param   length      Number of bytes to copy.
+ * @return  Number of bytes copied (or -1 on error).
+ **/
+static off_t copy_file(int fd, FILE *stream, off_t offset, off_t length) {
+    char buffer[BUFSIZ];
+    off_t ncopied = 0;
+
+    while (ncopied < length) {
+        size_t  nwant = length - ncopied < BUFSIZ ? length - ncopied : BUFSIZ;
+        ssize_t nread = pread(fd, buffer, nwant, offset + ncopied);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return nread < 0 ? -1 : ncopied;
+        }
+        if (fwrite(buffer, 1, nread, stream) != (size_t)nread) {
+            return -1;
+        }
+        ncopied += nread;
+    }
+    return ncopied;
+}
+
+/**
+ * Send part of file directly to socket with sendfile.
+ *
+ * @param   fd          File descriptor of file.
+ * @param   sfd         Socket file descriptor.
+ * @param   offset      Offset of first byte to send.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes sent (or -1 on error).
+ *
+ * If nothing could be sent because sendfile does not support the file, the
+ * caller can still fall back to copy_file.
+ **/
+static off_t send_file(int fd, int sfd, off_t offset, off_t length) {
+    off_t start = offset;
+
+    while (offset - start < length) {
+        ssize_t nsent = sendfile(sfd, fd, &offset, length - (offset - start));
+        if (nsent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nsent <= 0) {
+            debug("Unable to sendfile: %s", strerror(errno));
+            break;
+        }
+    }
+    return offset > start ? offset - start : -1;
+}
+
+/**
+ * Send part of requested file as response body.
  *
  * @param   r           HTTP Request structure.
- * @return  Status of the HTTP file request.
+ * @param   f           CachedFile structure of file (NULL if not cached).
+ * @param   offset      Offset of first byte to send.
+ * @param   length      Number of bytes to send.
+ * @return  -1 on error and 0 on success.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * Cached contents are written from memory.  Otherwise, the bytes go out
+ * with sendfile (no copies through user space), falling back to copying
+ * them into the stream if sendfile does not support the file.
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * On a non-blocking connection, the file is left to the event loop instead
+ * (see connection->file), which sends it with sendfile whenever the socket
+ * is writable, so this must be the last part of the response.
  **/
-Status  handle_file_request(Request *r) {
-    log("entered handle_file_request");
-    FILE *file_stream;
-    char buffer[BUFSIZ];
-    char *mtype = NULL;
-    size_t nread;
+static int send_body(Request *r, CachedFile *f, off_t offset, off_t length) {
+    Connection *connection = r->connection;
+    FILE *stream = connection->stream;
 
-    /* Open file for reading */
-    file_stream = fopen(r->path, "r");
-    if( !file_stream ){
-      fprintf(stderr, "fopen failed: %s\n", strerror(errno));
-      log("fopen failed");
-      return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    if (r->head) {
+        return 0;
     }
 
-    /* Determine mimetype */
-    mtype = determine_mimetype(r->path);
-    if ( !mtype ) {
-        debug("MimeType Memory Allocation Error: %s", strerror(errno));
-        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    if (f) {
+        struct iovec iov = {f->data + f->nheader + offset, length};
+        return response_write(r, &iov, 1);
     }
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: %s\r\n", mtype);
-    fprintf(r->stream, "\r\n");
+    if (connection->nonblocking) {
+        if (r->fd < 0) {
+            return -1;
+        }
+        connection->file        = r->fd;
+        connection->file_offset = offset;
+        connection->file_length = length;
+        r->fd     = -1;
+        r->nsent += length;
+        return 0;
+    }
 
-    /* Read from file and write to socket in chunks */
-        nread = fread(buffer, 1, BUFSIZ, file_stream);
-        while ( nread > 0 ) {
-            if ( ! fwrite(buffer, 1, nread, r->stream) ) {
+    off_t nsent = -1;
+    int   sfd   = fileno(stream);
+    if (sfd >= 0 && fflush(stream) == 0) {
+        nsent = send_file(r->fd, sfd, offset, length);
+    }
+    if (nsent < 0) {
+        nsent = copy_file(r->fd, stream, offset, length);
+    }
+
+    if (nsent > 0) {
+        r->nsent += nsent;
+    }
+    return nsent == length ? 0 : -1;
+}
+
+/**
+ * Parse Range header.
+ *
+ * @param   header      Data of Range header.
+ * @param   size        Size of requested file.
+ * @param   ranges      Array of RANGE_MAX ranges to store satisfiable ranges in.
+ * @return  Number of satisfiable ranges (0 if none is), or -1 if the header
+ * is malformed or asks for too many ranges (so it should be ignored).
+ *
+ * Ranges come in the form:
+ *
+ *  bytes=<FIRST>-<LAST>, <FIRST>-, -<SUFFIX>, ...
+ *
+ * Each range is clamped to the end of the file, and ranges starting past the
+ * end of the file are dropped.
+ **/
+static int parse_ranges(const char *header, off_t size, Range *ranges) {
+    int nspecs = 0;
+    int n = 0;
+    char *end;
+
+    if (strncasecmp(header, "bytes=", 6) != 0) {
+        return -1;
+    }
+
+    for (const char *s = header + 6; *s; s = end) {
+        off_t first, last;
+
+        while (*s == ' ' || *s == '\t' || *s == ',') {
+            s++;
+        }
+        if (!*s) {
+            break;
+        }
+
+        if (*s == '-' && isdigit(s[1])) {
+            off_t suffix = strtoll(s + 1, &end, 10);
+            first = suffix < size ? size - suffix : 0;
+            last  = suffix > 0 ? size - 1 : -1;
+        } else if (isdigit(*s)) {
+            first = strtoll(s, &end, 10);
+            if (*end++ != '-') {
+                return -1;
+            }
+            last = size - 1;
+            if (isdigit(*end)) {
+                last = strtoll(end, &end, 10);
+                if (last < first) {
+                    return -1;
+                }
+            }
+        } else {
+            return -1;
+        }
+
+        while (*end == ' ' || *end == '\t') {
+            end++;
+        }
+        if (*end && *end != ',') {
+            return -1;
+        }
+        nspecs++;
+
+        /* Keep satisfiable range */
+        if (first < size && first <= last) {
+            if (n == RANGE_MAX) {
+                return -1;
+            }
+            ranges[n].first = first;
+            ranges[n].last  = last < size ? last : size - 1;
+            n++;
+        }
+    }
+
+    return nspecs ? n : -1;
+}
+
+/**
+ * Handle byte range request for file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of the opened file.
+ * @param   f           Referenced CachedFile structure of file (NULL if not
+ * cached), which is released.
+ * @param   ranges      Satisfiable ranges of file.
+ * @param   nranges     Number of ranges (0 if none is satisfiable).
+ * @return  Status of the HTTP file request.
+ *
+ * A single range is sent as the body of a 206 response with a Content-Range
+ * header.  Several ranges are sent as a multipart/byteranges body, with a
+ * Content-Range header in front of each part.  If no range is satisfiable,
+ * then the response is 416 with the size of the file.
+ *
+ * The multipart boundary is random, so the contents of the file cannot be
+ * made to contain it.
+ *
+ * Cached parts go out together with the header in a single writev.
+ * Otherwise, every part is sent straight from the file at its offset, while
+ * the socket is corked so the headers share frames with the data.
+ **/
+static Status handle_range_request(Request *r, struct stat *sb, CachedFile *f, Range *ranges, int nranges) {
+    Arena *arena         = &r->connection->arena;
+    FILE *stream         = r->connection->stream;
+    const char *mimetype = determine_mimetype(r->path);
+    intmax_t size        = sb->st_size;
+    Response response;
+    struct iovec body[2 * RANGE_MAX + 1];
+    int nbody            = 0;
+    char *parts[RANGE_MAX];
+    char *trailer        = NULL;
+    Status status        = HTTP_STATUS_PARTIAL_CONTENT;
+    int result;
+
+    if (nranges == 0) {
+        status = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+        response_start(&response, status);
+        response_field(&response, "Content-Range", "bytes */%jd", size);
+        response_field(&response, "Content-Length", "0");
+    } else if (nranges == 1) {
+        start_response(&response, status, mimetype, ranges[0].last - ranges[0].first + 1);
+        response_field(&response, "Content-Range", "bytes %jd-%jd/%jd",
+            (intmax_t)ranges[0].first, (intmax_t)ranges[0].last, size);
+        add_cache_fields(&response, sb, mimetype, NULL);
+    } else {
+        /* Render part headers to determine length of multipart body */
+        uintmax_t boundary;
+        intmax_t  length   = 0;
+
+        if (getrandom(&boundary, sizeof(boundary), 0) != sizeof(boundary)) {
+            debug("Unable to generate boundary: %s", strerror(errno));
+            goto fail;
+        }
+
+        for (int i = 0; i < nranges; i++) {
+            parts[i] = arena_printf(arena,
+                "\r\n--%016jx\r\nContent-Type: %s\r\nContent-Range: bytes %jd-%jd/%jd\r\n\r\n",
+                boundary, mimetype, (intmax_t)ranges[i].first, (intmax_t)ranges[i].last, size);
+            if (!parts[i]) {
                 goto fail;
             }
-            nread = fread(buffer, 1, BUFSIZ, file_stream);
+            length += strlen(parts[i]) + ranges[i].last - ranges[i].first + 1;
         }
-     /* Close file, deallocate mimetype, return OK */
-    fclose(file_stream);
-    free(mtype);
-    return HTTP_STATUS_OK;
+
+        trailer = arena_printf(arena, "\r\n--%016jx--\r\n", boundary);
+        if (!trailer) {
+            goto fail;
+        }
+        length += strlen(trailer);
+
+        response_start(&response, status);
+        response_field(&response, "Content-Type", "multipart/byteranges; boundary=%016jx", boundary);
+        response_field(&response, "Content-Length", "%jd", length);
+        add_cache_fields(&response, sb, mimetype, NULL);
+    }
+
+    if (f || nranges == 0) {
+        /* Send header, then each cached range (with its part header) */
+        for (int i = 0; i < nranges; i++) {
+            if (trailer) {
+                body[nbody++] = (struct iovec){parts[i], strlen(parts[i])};
+            }
+            body[nbody++] = (struct iovec){f->data + f->nheader + ranges[i].first, ranges[i].last - ranges[i].first + 1};
+        }
+        if (trailer) {
+            body[nbody++] = (struct iovec){trailer, strlen(trailer)};
+        }
+        result = response_send(r, &response, body, nbody);
+    } else {
+        /* Send header, then each range from the file (with its part header) */
+        int sfd = fileno(stream);
+        bool corked = sfd >= 0 && socket_cork(sfd, true) == 0;
+        struct iovec iov;
+
+        result = response_send(r, &response, NULL, 0);
+        for (int i = 0; i < nranges && result == 0 && !r->head; i++) {
+            if (trailer) {
+                iov = (struct iovec){parts[i], strlen(parts[i])};
+                result = response_write(r, &iov, 1);
+            }
+            if (result == 0) {
+                result = send_body(r, NULL, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+            }
+        }
+
+        if (result == 0 && trailer && !r->head) {
+            iov = (struct iovec){trailer, strlen(trailer)};
+            result = response_write(r, &iov, 1);
+        }
+
+        if (corked) {
+            if (fflush(stream) != 0) {
+                result = -1;
+            }
+            socket_cork(sfd, false);
+        }
+    }
+
+    if (f) {
+        filecache_release(f);
+    }
+
+    if (result < 0) {
+        /* Header already promised more than was sent */
+        r->keep_alive = false;
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    return status;
 
 fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    fclose(file_stream);
-    free(mtype);
+    if (f) {
+        filecache_release(f);
+    }
     return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
 }
 
 /**
- * Handle CGI request
+ * Send header and body of file that is not cached.
+ *
+ * @param   r           HTTP Request structure (whose fd is sent).
+ * @param   response    Response structure with header of file.
+ * @param   length      Length of file.
+ * @return  Status of the HTTP file request.
+ *
+ * The body is sent with send_body while the socket is corked, so the header
+ * and the start of the body share frames.
+ **/
+static Status send_uncached_file(Request *r, Response *response, off_t length) {
+    FILE *stream = r->connection->stream;
+
+    int sfd = fileno(stream);
+    bool corked = sfd >= 0 && socket_cork(sfd, true) == 0;
+
+    int result = response_send(r, response, NULL, 0);
+    if (result == 0) {
+        result = send_body(r, NULL, 0, length);
+    }
+
+    if (corked) {
+        if (fflush(stream) != 0) {
+            result = -1;
+        }
+        socket_cork(sfd, false);
+    }
+
+    if (result < 0) {
+        /* Header already promised more than was sent: close connection,
+         * return INTERNAL_SERVER_ERROR */
+        r->keep_alive = false;
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Open precompressed sidecar of requested file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of requested file.
+ * @param   extension   Extension of sidecar (i.e. .gz).
+ * @param   ssb         Stat to store stat of sidecar in.
+ * @return  Open file descriptor of sidecar (or -1 if there is no current one).
+ *
+ * A sidecar older than the file it was compressed from is stale and ignored.
+ **/
+static int open_sidecar(Request *r, struct stat *sb, const char *extension, struct stat *ssb) {
+    const char *uri = arena_printf(&r->connection->arena, "%s%s", request_string(r, r->uri), extension);
+    int fd = uri ? open_request_path(uri) : -1;
+
+    if (fd >= 0 && (fstat(fd, ssb) < 0 || !S_ISREG(ssb->st_mode) ||
+        ssb->st_mtim.tv_sec < sb->st_mtim.tv_sec ||
+        (ssb->st_mtim.tv_sec == sb->st_mtim.tv_sec && ssb->st_mtim.tv_nsec < sb->st_mtim.tv_nsec))) {
+        debug("Ignoring stale sidecar %s", uri);
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * Select content coding of response for file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of requested file.
+ * @param   mimetype    Mimetype of requested file.
+ * @param   sfd         Pointer to store open sidecar in (-1 if there is none).
+ * @param   ssb         Stat to store stat of sidecar in.
+ * @return  Selected content coding (or NULL for identity).
+ *
+ * Precompressed .br and .gz sidecars are preferred (in that order).
+ * Otherwise, gzip responses are compressed on the fly, as long as the result
+ * can be kept in the file cache.
+ **/
+static const char * select_encoding(Request *r, struct stat *sb, const char *mimetype, int *sfd, struct stat *ssb) {
+    const char *accept = request_header(r, HEADER_ACCEPT_ENCODING);
+
+    *sfd = -1;
+    if (!accept || !encoding_negotiable(sb, mimetype)) {
+        return NULL;
+    }
+
+    if (compress_accepted(accept, "br") && (*sfd = open_sidecar(r, sb, ".br", ssb)) >= 0) {
+        return "br";
+    }
+    if (compress_accepted(accept, "gzip")) {
+        if ((*sfd = open_sidecar(r, sb, ".gz", ssb)) >= 0 || filecache_fits(sb->st_size)) {
+            return "gzip";
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Handle request for file itself (without content coding).
  *
  * @param   r           HTTP Request structure.
+ * @param   sb          Stat of requested file.
+ * @param   mimetype    Mimetype of requested file.
  * @return  Status of the HTTP file request.
+ **/
+static Status handle_identity_request(Request *r, struct stat *sb, const char *mimetype) {
+    CachedFile *f;
+    Response response;
+
+    /* Serve from file cache */
+    if ( (f = filecache_lookup(sb, NULL)) ) {
+        return send_cached_file(r, f);
+    }
+
+    /* Cache file with its response header, if it fits (on a helper thread) */
+    if (filecache_fits(sb->st_size) && handle_defer(r)) {
+        return HTTP_STATUS_OK;
+    }
+
+    start_response(&response, HTTP_STATUS_OK, mimetype, sb->st_size);
+    response_field(&response, "Accept-Ranges", "bytes");
+    add_cache_fields(&response, sb, mimetype, NULL);
+    if ( (f = filecache_insert(r->fd, sb, NULL, response.data)) ) {
+        return send_cached_file(r, f);
+    }
+
+    /* Write HTTP Headers with OK status, determined Content-Type, and size,
+     * followed by the file */
+    return send_uncached_file(r, &response, sb->st_size);
+}
+
+/**
+ * Handle request for encoded representation of file.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of requested file.
+ * @param   mimetype    Mimetype of requested file.
+ * @param   coding      Selected content coding.
+ * @param   sfd         Open sidecar (-1 to compress on the fly), which is
+ * closed.
+ * @param   ssb         Stat of sidecar.
+ * @return  Status of the HTTP file request.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * Sidecars are cached (and sent) just like plain files, but as a variant
+ * with the coding's header.  Files without a sidecar are compressed once and
+ * the result is cached as a variant of the file, so it is dropped as soon as
+ * the file changes.  Compressed output is never sent without being cached:
+ * if it cannot be, then the file itself is sent instead.
  **/
-Status handle_cgi_request(Request *r) {
-    log("entered handle_cgi_request");
-    FILE *pfs;
-    char buffer[BUFSIZ];
+static Status handle_encoded_request(Request *r, struct stat *sb, const char *mimetype, const char *coding, int sfd, struct stat *ssb) {
+    struct stat *esb = sfd >= 0 ? ssb : sb;
+    CachedFile *f;
+    Response response;
+    char *body;
+    size_t nbody;
+
+    /* Serve from file cache */
+    if ( (f = filecache_lookup(esb, coding)) ) {
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        return send_cached_file(r, f);
+    }
+
+    /* Leave compressing (or caching sidecar) to a helper thread */
+    if ((sfd < 0 || filecache_fits(ssb->st_size)) && handle_defer(r)) {
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        return HTTP_STATUS_OK;
+    }
+
+    /* Send sidecar instead of file */
+    if (sfd >= 0) {
+        close(r->fd);
+        r->fd = sfd;
+    }
+
+    /* Compress file unless it has a sidecar */
+    if (sfd < 0) {
+        if (!(body = compress_file(r->fd, sb->st_size, &nbody))) {
+            return handle_identity_request(r, sb, mimetype);
+        }
+        debug("Compressed %s from %jd to %zu bytes", r->path, (intmax_t)sb->st_size, nbody);
+    }
+
+    /* Format header with Content-Encoding and validators of the file */
+    start_response(&response, HTTP_STATUS_OK, mimetype, sfd >= 0 ? ssb->st_size : (off_t)nbody);
+    response_field(&response, "Content-Encoding", "%s", coding);
+    add_cache_fields(&response, sb, mimetype, coding);
+
+    /* Send sidecar (from the file cache, if it fits) */
+    if (sfd >= 0) {
+        if ( (f = filecache_insert(sfd, ssb, coding, response.data)) ) {
+            return send_cached_file(r, f);
+        }
+        return send_uncached_file(r, &response, ssb->st_size);
+    }
+
+    /* Cache compressed file (or send the file itself) */
+    f = filecache_insert_variant(sb, coding, response.data, body, nbody);
+    free(body);
+    if (f) {
+        return send_cached_file(r, f);
+    }
+    return handle_identity_request(r, sb, mimetype);
+}
+
+/**
+ * Handle file request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of the opened file.
+ * @return  Status of the HTTP file request.
+ *
+ * This streams the contents of the opened file to the socket.
+ *
+ * Files that fit in the file cache are read into memory (together with their
+ * response header) on first use and served from there afterwards.
+ * Otherwise, the file is sent with send_uncached_file.
+ *
+ * Every response carries the ETag and Last-Modified validators of the file
+ * (and its configured Cache-Control).  Revalidation requests whose copy is
+ * still current (If-None-Match or If-Modified-Since) just get a 304 header.
+ *
+ * Requests with a Range header get just the requested bytes (see
+ * handle_range_request), unless If-Range shows their copy is stale.
+ *
+ * Other requests for compressible files get a compressed representation if
+ * the client accepts one (see select_encoding and handle_encoded_request).
+ **/
+Status  handle_file_request(Request *r, struct stat *sb) {
+    debug("entered handle_file_request");
+    CachedFile *f = NULL;
+    const char *mtype;
+    const char *coding = NULL;
+    Range ranges[RANGE_MAX];
+    int nranges = -1;
+    int sfd = -1;
+    struct stat ssb;
+
+    /* Determine mimetype */
+    mtype = determine_mimetype(r->path);
+
+    /* Parse byte ranges (unless the Range header has to be ignored, or
+     * If-Range shows the client's copy is stale) */
+    const char *range = request_header(r, HEADER_RANGE);
+    if (range && request_range_applies(r, sb)) {
+        nranges = parse_ranges(range, sb->st_size, ranges);
+    }
+
+    /* The event loop only sends one piece of an uncached file per response
+     * (see send_body), so it serves several ranges of one as the whole file */
+    if (nranges > 1 && r->connection->nonblocking && !(f = filecache_lookup(sb, NULL))) {
+        nranges = -1;
+    }
+
+    /* Negotiate content coding (byte ranges are always of the file itself) */
+    if (nranges < 0) {
+        coding = select_encoding(r, sb, mtype, &sfd, &ssb);
+    }
+
+    /* Answer revalidation of current representation without the body */
+    if (request_not_modified(r, sb, coding)) {
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        if (f) {
+            filecache_release(f);
+        }
+        return handle_not_modified(r, sb, mtype, coding);
+    }
+
+    /* Serve byte ranges */
+    if (nranges >= 0) {
+        return handle_range_request(r, sb, f ? f : filecache_lookup(sb, NULL), ranges, nranges);
+    }
+
+    /* Serve encoded representation */
+    if (coding) {
+        return handle_encoded_request(r, sb, mtype, coding, sfd, &ssb);
+    }
+
+    return handle_identity_request(r, sb, mtype);
+}
+
+/**
+ * Append CGI environment variable to environment block.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   envp        Environment block.
+ * @param   n           Pointer to number of entries in environment block.
+ * @param   name        Name of variable.
+ * @param   value       Value of variable.
+ * @return  -1 on error and 0 on success.
+ **/
+static int cgi_export(Request *r, char **envp, size_t *n, const char *name, const char *value) {
+    if (!(envp[*n] = arena_printf(&r->connection->arena, "%s=%s", name, value))) {
+        debug("Error: Unable to set %s: %s", name, strerror(errno));
+        return -1;
+    }
+    (*n)++;
+    return 0;
+}
+
+/**
+ * Build CGI environment block for request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   nenviron    Pointer to number of entries that are not CGI
+ * variables.
+ * @return  NULL-terminated environment block (or NULL on error).
+ *
+ * The block consists of PATH (the only variable taken from the server's
+ * environment, so none of its other settings or secrets leak to scripts)
+ * followed by the CGI variables for the request, starting with
+ * CONTENT_LENGTH (unless the body is sent in chunks, so its length is not
+ * known up front).
+ *
+ * The block and the variables are allocated from the connection arena, so
+ * they are released along with the request, and the process environment
+ * itself is never modified.
+ **/
+static char ** cgi_environment(Request *r, size_t *nenviron) {
+    size_t n = 0;
+
+    char **envp = arena_alloc(&r->connection->arena, (1 + 9 + NCGIHeaders + 1) * sizeof(char *));
+    if (!envp) {
+        debug("Error: Unable to allocate environment: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (cgi_export(r, envp, &n, "PATH", getenv("PATH") ? getenv("PATH") : CGI_PATH) < 0) {
+        return NULL;
+    }
+    *nenviron = n;
 
     /* Export CGI environment variables from request:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    if (setenv("DOCUMENT_ROOT", RootPath, 1) < 0) {
-        debug("Error: Unable to set %s", strerror(errno));
+    if (!r->chunked) {
+        char length[32];
+        snprintf(length, sizeof(length), "%jd", (intmax_t)r->nbody);
+        if (cgi_export(r, envp, &n, "CONTENT_LENGTH", length) < 0)
+            return NULL;
+    }
+
+    if (cgi_export(r, envp, &n, "DOCUMENT_ROOT", RootPath)     < 0 ||
+        cgi_export(r, envp, &n, "QUERY_STRING", request_string(r, r->query))      < 0 ||
+        cgi_export(r, envp, &n, "REMOTE_ADDR", r->connection->host)        < 0 ||
+        cgi_export(r, envp, &n, "REMOTE_PORT", r->connection->port)        < 0 ||
+        cgi_export(r, envp, &n, "REQUEST_METHOD", request_string(r, r->method))   < 0 ||
+        cgi_export(r, envp, &n, "REQUEST_URI", request_string(r, r->uri))         < 0 ||
+        cgi_export(r, envp, &n, "SCRIPT_FILENAME", r->path)    < 0 ||
+        cgi_export(r, envp, &n, "SERVER_PORT", Port)           < 0) {
+        return NULL;
+    }
+
+    /* Export CGI environment variables from request headers */
+    for (size_t i = 0; i < NCGIHeaders; i++) {
+        const char *data = request_header(r, CGIHeaders[i].header);
+        if (data && cgi_export(r, envp, &n, CGIHeaders[i].variable, data) < 0)
+            return NULL;
+    }
+
+    envp[n] = NULL;
+    return envp;
+}
+
+/**
+ * Relay CGI output to socket.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Pipe (or worker socket) of CGI output.
+ * @param   input       Pipe (or worker socket) of CGI input (-1 if the
+ * request has no body).
+ * @return  Status of the HTTP CGI request.
+ *
+ * The request body is sent to the script while its output is relayed (see
+ * relay_upload), and then the rest of the output is relayed.  The script's
+ * header is turned into the response header and its body is relayed after
+ * it (see relay.c), so the connection can persist.
+ *
+ * On a non-blocking connection, the descriptors are made non-blocking too
+ * and the relay is handed to the event loop (see event.c), which sends the
+ * body and relays the output as the client and script are ready, so a slow
+ * client or script never stalls other clients.  Otherwise, the output is
+ * relayed until the script closes its end.
+ **/
+static Status relay_cgi_output(Request *r, int fd, int input) {
+    Relay *relay = relay_create(r, fd, input);
+    if (!relay) {
+        close(fd);
+        if (input >= 0) {
+            close(input);
+        }
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Invite client that waits for permission to send the body (flushed
+     * now, since the body is awaited before any response is written) */
+    if (r->expect_continue && !connection_pending(r->connection)) {
+        if (fputs("HTTP/1.1 100 Continue\r\n\r\n", r->connection->stream) == EOF ||
+            fflush(r->connection->stream) != 0) {
+            debug("Unable to send 100 Continue: %s", strerror(errno));
+            relay_free(relay);
+            r->keep_alive = false;
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (r->connection->nonblocking && socket_nonblocking(fd, true) == 0 && (input < 0 || socket_nonblocking(input, true) == 0)) {
+        r->connection->relay = relay;
+        return HTTP_STATUS_OK;
+    }
+
+    if (input >= 0 && relay_upload(relay, r) < 0) {
+        Status status = errno == EFBIG   ? HTTP_STATUS_PAYLOAD_TOO_LARGE :
+                        errno == EBADMSG ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_BAD_REQUEST;
+        bool started  = relay->started;
+        debug("Unable to send request body: %s", strerror(errno));
+        relay_free(relay);
+
+        /* Part of the response may already be sent */
+        if (started) {
+            r->keep_alive = false;
+            return status;
+        }
+        return handle_error(r, status);
+    }
+
+    int status = relay_send(relay, r);
+    r->keep_alive = relay->keep_alive;
+    relay_free(relay);
+
+    if (status < 0) {
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    if (setenv("QUERY_STRING", r->query, 1) < 0) {
-        debug("Error: Unable to set %s", strerror(errno));
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle CGI request with persistent worker of pooled script.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   pool        Index of pool of script.
+ * @return  Status of the HTTP CGI request.
+ *
+ * The request is sent to the pool as SCGI: a netstring of NUL separated CGI
+ * variables (CONTENT_LENGTH first, and SCGI last), followed by the body.  The
+ * worker's output is then relayed to the socket until the worker closes the
+ * connection (see relay_cgi_output).
+ **/
+static Status handle_pooled_cgi_request(Request *r, int pool) {
+    static const char trailer[] = "SCGI\0" "1\0";
+    size_t nenviron;
+
+    /* Wait for a worker on a helper thread */
+    if (handle_defer(r)) {
+        return HTTP_STATUS_OK;
+    }
+
+    /* Build CGI environment and encode its CGI variables as a netstring */
+    char **envp = cgi_environment(r, &nenviron);
+    if (!envp) {
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    if (setenv("REMOTE_ADDR", r->host, 1) < 0) {
-        debug("Error: Unable to set %s", strerror(errno));
+
+    size_t nheaders = sizeof(trailer) - 1;
+    for (char **e = envp + nenviron; *e; e++) {
+        nheaders += strlen(*e) + 1;
+    }
+
+    char *headers = arena_alloc(&r->connection->arena, nheaders + 32);
+    if (!headers) {
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    if (setenv("REMOTE_PORT", r->port, 1) < 0) {
-        debug("Error: Unable to set %s", strerror(errno));
+
+    size_t n = sprintf(headers, "%zu:", nheaders);
+    for (char **e = envp + nenviron; *e; e++) {
+        size_t length = strlen(*e) + 1;
+        memcpy(headers + n, *e, length);
+        *strchr(headers + n, '=') = '\0';
+        n += length;
+    }
+    memcpy(headers + n, trailer, sizeof(trailer) - 1);
+    n += sizeof(trailer) - 1;
+    headers[n++] = ',';
+
+    /* Send request to worker (waiting in the listen backlog if all are busy) */
+    int fd = cgipool_connect(pool);
+    if (fd < 0) {
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    if (setenv("REQUEST_METHOD", r->method, 1) < 0) {
-        debug("Error: Unable to set %s", strerror(errno));
+
+    struct iovec iov = {headers, n};
+    if (socket_writev(fd, &iov, 1) < 0) {
+        debug("Unable to send request to worker: %s", strerror(errno));
+        close(fd);
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    if (setenv("REQUEST_URI", r->uri, 1) < 0) {
-        debug("Error: Unable to set %s", strerror(errno));
+
+    /* Send body through its own descriptor of the socket, so the event loop
+     * can wait for it to be writable separately */
+    int input = -1;
+    if (r->body != BODY_NONE && (input = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        debug("Unable to dup: %s", strerror(errno));
+        close(fd);
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    if (setenv("SCRIPT_FILENAME", r->path, 1) < 0) {
-        debug("Error: Unable to set %s", strerror(errno));
+
+    /* Relay output of worker to socket */
+    return relay_cgi_output(r, fd, input);
+}
+
+/**
+ * Spawn CGI script.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   envp        Environment block of script.
+ * @param   output      Descriptor to connect to script's stdout.
+ * @param   input       Descriptor to connect to script's stdin (-1 if none).
+ * @return  Process id of script (or -1 on error).
+ *
+ * The script is executed from the descriptor that was opened (and checked)
+ * for the request, rather than by path, so it cannot be swapped out in
+ * between.  The descriptor is left open across exec, since interpreters of
+ * #! scripts read the script through it.
+ *
+ * Like posix_spawn, this uses vfork, so the cost does not depend on the
+ * server's memory footprint.  Signals are blocked until the child has reset
+ * every handler (and SIGCHLD and SIGPIPE, which the server ignores) to the
+ * default, and an exec error is passed back through the shared memory.
+ **/
+static pid_t cgi_spawn(Request *r, char **envp, int output, int input) {
+    char *argv[] = {r->path, NULL};
+    struct sigaction defaults = {.sa_handler = SIG_DFL};
+    sigset_t all, mask, none;
+    volatile int error = 0;
+
+    sigfillset(&all);
+    sigemptyset(&none);
+    pthread_sigmask(SIG_SETMASK, &all, &mask);
+
+    pid_t pid = vfork();
+    if (pid == 0) {
+        for (int signum = 1; signum < NSIG; signum++) {
+            sigaction(signum, &defaults, NULL);
+        }
+        pthread_sigmask(SIG_SETMASK, &none, NULL);
+
+        if (dup2(output, STDOUT_FILENO) < 0 ||
+            (input >= 0 && dup2(input, STDIN_FILENO) < 0) ||
+            fcntl(r->fd, F_SETFD, 0) < 0) {
+            error = errno;
+            _exit(EXIT_FAILURE);
+        }
+
+        fexecve(r->fd, argv, envp);
+        error = errno;
+        _exit(EXIT_FAILURE);
+    }
+    if (pid < 0) {
+        error = errno;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+    if (error) {
+        debug("Unable to spawn %s: %s", r->path, strerror(error));
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+        errno = error;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Handle CGI request
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sb          Stat of script.
+ * @return  Status of the HTTP file request.
+ *
+ * This executes the specified executable with the CGI environment, sends it
+ * the request body (if any) on its stdin, and streams its output to the
+ * socket.  Pooled scripts (see cgipool_add) are instead handled by one of
+ * their persistent workers, unless the body is sent in chunks (SCGI needs
+ * its length up front).
+ *
+ * If the executable cannot be started, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+Status handle_cgi_request(Request *r, struct stat *sb) {
+    debug("entered handle_cgi_request");
+    size_t nenviron;
+    int pipefd[2];
+    int inputfd[2] = {-1, -1};
+    pid_t pid;
+
+    /* Dispatch pooled script to persistent worker */
+    int pool = cgipool_find(sb);
+    if (pool >= 0 && !r->chunked) {
+        return handle_pooled_cgi_request(r, pool);
+    }
+
+    /* Build CGI environment */
+    char **envp = cgi_environment(r, &nenviron);
+    if (!envp) {
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    if (setenv("SERVER_PORT", Port, 1) < 0) {
-        debug("Error: Unable to set %s", strerror(errno));
+
+    /* Spawn CGI Script directly (no shell) with its stdout (and stdin, if
+     * there is a body) connected to a pipe */
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        debug("Unable to pipe: %s", strerror(errno));
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    /* Export CGI environment variables from request headers */
-    for (Header *h = r->headers; h; h = h->next) {
-        if (streq(h->name, "Accept"))
-	    setenv("HTTP_ACCEPT", h->data, 1);
-	if (streq(h->name, "Accept-Encoding"))
-  	    setenv("HTTP_ACCEPT_ENCODING", h->data, 1);
-  	if (streq(h->name, "Accept-Language"))
-	    setenv("HTTP_ACCEPT_LANGUAGE", h->data, 1);
-	if (streq(h->name, "Connection"))
-	    setenv("HTTP_CONNECTION", h->data, 1);
-	if (streq(h->name, "Host"))
-	    setenv("HTTP_HOST", h->data, 1);
-	if (streq(h->name, "User-Agent"))
-	    setenv("HTTP_USER_AGENT", h->data, 1);
-    }
-
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
-    if(!pfs) {
+    if (r->body != BODY_NONE && pipe2(inputfd, O_CLOEXEC) < 0) {
+        debug("Unable to pipe: %s", strerror(errno));
+        close(pipefd[0]);
+        close(pipefd[1]);
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    /* Copy data from popen to socket */
+    pid = cgi_spawn(r, envp, pipefd[1], inputfd[0]);
 
-    while(fgets(buffer, BUFSIZ, pfs)){
-        fputs(buffer, r->stream);
+    close(pipefd[1]);
+    if (inputfd[0] >= 0) {
+        close(inputfd[0]);
     }
 
-    /* Close popen, return OK */
-    pclose(pfs);
-    return HTTP_STATUS_OK;
+    if (pid < 0) {
+        close(pipefd[0]);
+        if (inputfd[1] >= 0) {
+            close(inputfd[1]);
+        }
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Relay body and output, then reap script (unless the event loop relays
+     * them); a script whose request failed may still be waiting for either */
+    Status result = relay_cgi_output(r, pipefd[0], inputfd[1]);
+    if (!r->connection->relay) {
+        if (result != HTTP_STATUS_OK) {
+            kill(pid, SIGTERM);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return result;
 }
 
 /**
@@ -293,54 +1557,36 @@ Status handle_cgi_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP error request.
  *
- * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * This writes the error response pre-rendered by templates_load: an HTTP
+ * status error code followed by an HTML message to notify the user of the
+ * error.
  **/
 Status  handle_error(Request *r, Status status) {
-    log("entered handle_error");
-    const char *statString = http_status_string(status);
+    debug("entered handle_error");
+    size_t size;
 
-    /* Write HTTP Header */
-    fprintf(r->stream, "HTTP/1.0 %s\r\n", statString);
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
+    /* Request body is not read */
+    request_body_discard(r);
 
-    FILE *fhtml = fopen("www/main.html","r");
-    size_t nread;
-    char buffer[BUFSIZ];
-    if( !fhtml ){
-      fprintf(stderr, "fopen failed: %s\n", strerror(errno));
-      log("fopen failed");
-      return handle_error(r, HTTP_STATUS_NOT_FOUND);
-    }
+    const char *page = templates_error(status, r->keep_alive, r->head, &size);
+    if ( !page ) {
+        Response response;
+        char body[BUFSIZ];
+        int n = snprintf(body, sizeof(body), "<h1>%s</h1>\n", http_status_string(status));
 
-    nread = fread(buffer, 1, BUFSIZ, fhtml);
-    while ( nread > 0 ) {
-        if ( ! fwrite(buffer, 1, nread, r->stream) ) {
-            fclose(fhtml);
-            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        start_response(&response, status, "text/html", n);
+        struct iovec iov = {body, n};
+        if (response_send(r, &response, &iov, 1) < 0) {
+            r->keep_alive = false;
         }
-        nread = fread(buffer, 1, BUFSIZ, fhtml);
-    }
-    fclose(fhtml);
-    fprintf(r->stream, "<h1>%s</h1>\n",statString);
-    /* Write HTML Description of Error*/
-    FILE *errhtml = fopen("www/error.html","r");
-    if( !errhtml ){
-      fprintf(stderr, "fopen failed: %s\n", strerror(errno));
-      log("fopen failed");
-      return handle_error(r, HTTP_STATUS_NOT_FOUND);
+        return status;
     }
 
-    nread = fread(buffer, 1, BUFSIZ, errhtml);
-    while ( nread > 0 ) {
-        if ( ! fwrite(buffer, 1, nread, r->stream) ) {
-            fclose(errhtml);
-            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
-        }
-        nread = fread(buffer, 1, BUFSIZ, errhtml);
+    struct iovec iov = {(char *)page, size};
+    if (response_write(r, &iov, 1) < 0) {
+        r->keep_alive = false;
     }
-    fclose(errhtml);
+
     /* Return specified status */
     return status;
 }
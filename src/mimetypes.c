@@ -0,0 +1,302 @@
+/* mimetypes.c: Mime-Type Table */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+/**
+ * Extension to mimetype mapping
+ */
+typedef struct {
+    const char *extension;              /*< File extension (without the .) */
+    const char *mimetype;               /*< Corresponding mimetype */
+} MimeType;
+
+/**
+ * Immutable extension to mimetype hash table (open addressing)
+ */
+typedef struct MimeTypes {
+    char             *data;             /*< Contents of mime.types file */
+    MimeType         *entries;          /*< Hash table slots */
+    size_t            capacity;         /*< Number of slots (power of 2) */
+    struct MimeTypes *retired;          /*< Table this one replaced */
+} MimeTypes;
+
+/* Constants */
+
+#define CACHE_CONTROL_MAX   32          /* Most Cache-Control rules */
+
+/**
+ * Mimetype to Cache-Control mapping
+ */
+typedef struct {
+    const char *pattern;                /*< Mimetype, type/\* wildcard, or \* */
+    size_t      npattern;               /*< Length of pattern */
+    const char *directives;             /*< Value of Cache-Control header */
+} CacheControl;
+
+/* Global Variables */
+
+static MimeTypes             *Table  = NULL;    /* Current table */
+static volatile sig_atomic_t  Reload = false;   /* Whether SIGHUP was received */
+
+static CacheControl CacheControls[CACHE_CONTROL_MAX];   /* Cache-Control rules */
+static size_t       NCacheControls = 0;                 /* Number of rules */
+
+/**
+ * Insert mapping into table unless the extension is already present.
+ *
+ * @param   t           MimeTypes structure.
+ * @param   extension   File extension.
+ * @param   mimetype    Corresponding mimetype.
+ *
+ * The earliest rule for an extension wins, just like a scan of the file would.
+ **/
+static void mimetypes_insert(MimeTypes *t, const char *extension, const char *mimetype) {
+    size_t i = hash_string(extension) & (t->capacity - 1);
+
+    while (t->entries[i].extension) {
+        if (streq(t->entries[i].extension, extension)) {
+            return;
+        }
+        i = (i + 1) & (t->capacity - 1);
+    }
+
+    t->entries[i].extension = extension;
+    t->entries[i].mimetype  = mimetype;
+}
+
+/**
+ * Deallocate table.
+ *
+ * @param   t           MimeTypes structure.
+ **/
+static void mimetypes_free(MimeTypes *t) {
+    if (t) {
+        free(t->entries);
+        free(t->data);
+        free(t);
+    }
+}
+
+/**
+ * Parse mime.types file into a new table.
+ *
+ * @param   path        Path to mime.types file.
+ * @return  Newly allocated MimeTypes structure (or NULL on error).
+ *
+ * The file (typically /etc/mime.types) consists of rules in the following
+ * format:
+ *
+ *  <MIMETYPE>      <EXT1> <EXT2> ...
+ *
+ * The whole file is read into one buffer and tokenized in place, so every
+ * extension and mimetype in the table points into that buffer.
+ **/
+static MimeTypes * mimetypes_parse(const char *path) {
+    MimeTypes *t = calloc(1, sizeof(MimeTypes));
+    FILE *fs     = fopen(path, "r");
+    struct stat sb;
+
+    if (!t || !fs || fstat(fileno(fs), &sb) < 0) {
+        debug("Unable to open %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    /* Read whole file */
+    t->data = malloc(sb.st_size + 1);
+    if (!t->data) {
+        goto fail;
+    }
+    size_t ndata = fread(t->data, 1, sb.st_size, fs);
+    t->data[ndata] = '\0';
+
+    /* Size table for at most half of the slots to be used */
+    size_t ntokens = 0;
+    for (char *s = skip_whitespace(t->data); *s; s = skip_whitespace(skip_nonwhitespace(s))) {
+        ntokens++;
+    }
+    for (t->capacity = 16; t->capacity < 2 * ntokens; t->capacity *= 2);
+
+    t->entries = calloc(t->capacity, sizeof(MimeType));
+    if (!t->entries) {
+        goto fail;
+    }
+
+    /* Add each extension of each rule */
+    char *lineptr;
+    for (char *line = strtok_r(t->data, "\n", &lineptr); line; line = strtok_r(NULL, "\n", &lineptr)) {
+        char *saveptr;
+        char *mimetype = strtok_r(line, WHITESPACE, &saveptr);
+        if (!mimetype || mimetype[0] == '#') {
+            continue;
+        }
+
+        char *extension;
+        while ((extension = strtok_r(NULL, WHITESPACE, &saveptr))) {
+            mimetypes_insert(t, extension, mimetype);
+        }
+    }
+
+    fclose(fs);
+    return t;
+
+fail:
+    if (fs) {
+        fclose(fs);
+    }
+    mimetypes_free(t);
+    return NULL;
+}
+
+/**
+ * Load mime.types file as the current mimetype table.
+ *
+ * @param   path        Path to mime.types file.
+ * @return  -1 on error and 0 on success.
+ *
+ * The new table is swapped in atomically, so concurrent lookups see either
+ * the old or the new table without taking a lock.  Mimetypes already handed
+ * out by the old table may still be in use, so replaced tables are kept
+ * (chained from the new one) rather than freed: reloads are rare, and this
+ * lets lookups return pointers into the table without counting references.
+ *
+ * On error, the current table (if any) is left in place.
+ **/
+int mimetypes_load(const char *path) {
+    MimeTypes *t = mimetypes_parse(path);
+    if (!t) {
+        log("Unable to load mimetypes from %s", path);
+        return -1;
+    }
+
+    t->retired = __atomic_exchange_n(&Table, t, __ATOMIC_ACQ_REL);
+    debug("Loaded mimetypes from %s", path);
+    return 0;
+}
+
+/**
+ * Record that the mimetype table should be reloaded (SIGHUP handler).
+ *
+ * @param   signum      Signal number.
+ **/
+void mimetypes_hangup(int signum) {
+    __atomic_store_n(&Reload, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reload mimetype table from MimeTypesPath if SIGHUP was received.
+ *
+ * Only the first caller after a SIGHUP performs the reload.  The file cache
+ * is dropped after a reload, since its response headers carry mimetypes from
+ * the old table.
+ **/
+void mimetypes_refresh(void) {
+    if (__atomic_load_n(&Reload, __ATOMIC_RELAXED) && __atomic_exchange_n(&Reload, false, __ATOMIC_ACQ_REL)) {
+        if (mimetypes_load(MimeTypesPath) == 0) {
+            filecache_flush();
+        }
+    }
+}
+
+/**
+ * Determine mime-type from file extension.
+ *
+ * @param   path        Path to file.
+ * @return  The mime-type of the specified file.
+ *
+ * This function finds the file's extension and looks it up in the table
+ * loaded by mimetypes_load.
+ *
+ * If no extension exists or no matching mimetype is found, then return
+ * DefaultMimeType.
+ *
+ * The returned string is owned by the table and must not be free'd.
+ **/
+const char * determine_mimetype(const char *path) {
+    const char *ext = strrchr(path, '.');
+
+    mimetypes_refresh();
+
+    MimeTypes *t = __atomic_load_n(&Table, __ATOMIC_ACQUIRE);
+    if ( !ext || !t ) {
+        return DefaultMimeType;
+    }
+    ext++;
+
+    for (size_t i = hash_string(ext) & (t->capacity - 1); t->entries[i].extension; i = (i + 1) & (t->capacity - 1)) {
+        if (streq(t->entries[i].extension, ext)) {
+            return t->entries[i].mimetype;
+        }
+    }
+
+    return DefaultMimeType;
+}
+
+/**
+ * Add Cache-Control rule.
+ *
+ * @param   rule        Rule of the form <PATTERN>=<DIRECTIVES>.
+ * @return  -1 on error and 0 on success.
+ *
+ * The pattern is either a mimetype (text/html), every subtype of a type
+ * (image/\*), or every mimetype (\*), and the directives are sent verbatim as
+ * the Cache-Control header of files with a matching mimetype:
+ *
+ *  image/\*=public, max-age=86400
+ *
+ * Rules are only added while parsing options, and the rule string must stay
+ * valid for the lifetime of the server.
+ **/
+int cache_control_add(const char *rule) {
+    const char *equals = strchr(rule, '=');
+
+    if (!equals || equals == rule || !equals[1] || NCacheControls == CACHE_CONTROL_MAX) {
+        log("Invalid Cache-Control rule: %s", rule);
+        return -1;
+    }
+
+    CacheControls[NCacheControls++] = (CacheControl){rule, equals - rule, equals + 1};
+    return 0;
+}
+
+/**
+ * Determine Cache-Control directives for mimetype.
+ *
+ * @param   mimetype    Mimetype of file.
+ * @return  Directives of the most specific matching rule (or NULL if no
+ * rule matches).
+ *
+ * An exact mimetype beats a type/\* wildcard, which beats \*.  Among rules
+ * that are equally specific, the earliest one wins.
+ **/
+const char * determine_cache_control(const char *mimetype) {
+    const char *directives = NULL;
+    int best = 0;
+
+    for (size_t i = 0; i < NCacheControls; i++) {
+        CacheControl *c = &CacheControls[i];
+        int score = 0;
+
+        if (c->npattern == 1 && c->pattern[0] == '*') {
+            score = 1;
+        } else if (c->npattern >= 2 && c->pattern[c->npattern - 1] == '*' && c->pattern[c->npattern - 2] == '/') {
+            score = strncmp(mimetype, c->pattern, c->npattern - 1) == 0 ? 2 : 0;
+        } else if (strncmp(mimetype, c->pattern, c->npattern) == 0 && mimetype[c->npattern] == '\0') {
+            score = 3;
+        }
+
+        if (score > best) {
+            best       = score;
+            directives = c->directives;
+        }
+    }
+
+    return directives;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,189 @@
+/* prefork.c: Pre-Forked HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PREFORK_BACKOFF_MAX 16  /* Maximum seconds between respawn retries */
+
+/* Global Variables */
+
+static volatile sig_atomic_t Stopping = false;
+static volatile sig_atomic_t Hangup   = false;
+
+/**
+ * Record that the server should stop (SIGINT/SIGTERM handler).
+ *
+ * @param   signum      Signal number.
+ **/
+static void prefork_stop(int signum) {
+    Stopping = true;
+}
+
+/**
+ * Record that the workers should reload their mimetypes (SIGHUP handler).
+ *
+ * @param   signum      Signal number.
+ **/
+static void prefork_hangup(int signum) {
+    Hangup = true;
+}
+
+/**
+ * Fork a worker process that accepts and handles requests.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Process id of worker (or -1 on error).
+ *
+ * Each worker runs its own accept loop on the shared server socket, so the
+ * kernel distributes incoming connections across the workers.
+ **/
+static pid_t prefork_spawn(int sfd) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unsuccesful fork: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        struct sigaction hangup = {.sa_handler = mimetypes_hangup, .sa_flags = SA_RESTART};
+        sigaction(SIGHUP, &hangup, NULL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        exit(single_server(sfd));
+    }
+
+    debug("Spawned worker %d", pid);
+    return pid;
+}
+
+/**
+ * Handle HTTP requests with a pool of pre-forked worker processes.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS or EXIT_FAILURE).
+ *
+ * The parent forks Workers long-lived processes up front and then only
+ * monitors them, respawning any worker that dies.  Slots whose fork failed
+ * are retried on every pass, sleeping with exponential backoff (up to
+ * PREFORK_BACKOFF_MAX seconds) while any remain empty; if no worker can be
+ * spawned at startup, the server fails instead.  On SIGHUP, the parent
+ * forwards the signal so that every worker reloads its mimetypes.  On SIGINT
+ * or SIGTERM, the parent terminates all of the workers and exits.
+ **/
+int prefork_server(int sfd) {
+    log("Entered Prefork Server");
+
+    pid_t *workers = calloc(Workers, sizeof(pid_t));
+    if (!workers) {
+        log("Unable to allocate workers: %s", strerror(errno));
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action = {.sa_handler = prefork_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct sigaction hangup = {.sa_handler = prefork_hangup};
+    sigaction(SIGHUP, &hangup, NULL);
+
+    /* Spawn initial workers (and give up if none could be forked) */
+    int spawned = 0;
+    for (int i = 0; i < Workers; i++) {
+        workers[i] = prefork_spawn(sfd);
+        spawned += workers[i] > 0;
+    }
+
+    if (!spawned) {
+        log("Unable to spawn any workers");
+        free(workers);
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    /* Respawn workers as they die */
+    unsigned int backoff = 1;
+    while (!Stopping) {
+        if (Hangup) {
+            Hangup = false;
+            for (int i = 0; i < Workers; i++) {
+                if (workers[i] > 0) {
+                    kill(workers[i], SIGHUP);
+                }
+            }
+        }
+
+        /* Retry slots whose worker could not be forked */
+        bool missing = false;
+        for (int i = 0; i < Workers; i++) {
+            if (workers[i] < 0) {
+                workers[i] = prefork_spawn(sfd);
+                missing |= workers[i] < 0;
+            }
+        }
+
+        if (!missing) {
+            backoff = 1;
+        }
+
+        /* Only poll while slots are missing, backing off between retries */
+        int status;
+        pid_t pid = waitpid(-1, &status, missing ? WNOHANG : 0);
+        if (pid == 0 || (pid < 0 && errno == ECHILD && missing)) {
+            sleep(backoff);
+            backoff = backoff * 2 > PREFORK_BACKOFF_MAX ? PREFORK_BACKOFF_MAX : backoff * 2;
+            continue;
+        }
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log("Unable to wait: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < Workers; i++) {
+            if (workers[i] != pid) {
+                continue;
+            }
+
+            if (WIFSIGNALED(status)) {
+                log("Worker %d killed by signal %d", pid, WTERMSIG(status));
+            } else {
+                log("Worker %d exited with status %d", pid, WEXITSTATUS(status));
+            }
+
+            if (!Stopping) {
+                workers[i] = prefork_spawn(sfd);
+            }
+            break;
+        }
+    }
+
+    /* Terminate workers (and only wait for them, since the CGI worker
+     * supervisor is also our child and exits on its own) */
+    for (int i = 0; i < Workers; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    for (int i = 0; i < Workers; i++) {
+        while (workers[i] > 0 && waitpid(workers[i], NULL, 0) < 0 && errno == EINTR);
+    }
+
+    /* Close server socket */
+    free(workers);
+    close(sfd);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,551 @@
+/* relay.c: CGI Output Relay */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define RELAY_FIELDS        64          /* Most header fields of a CGI response */
+
+/* Global Variables */
+
+static const char *HopByHopFields[] = { /* Fields that only describe the script's own output */
+    "Connection",
+    "Keep-Alive",
+    "Transfer-Encoding",
+};
+
+static const size_t NHopByHopFields = sizeof(HopByHopFields) / sizeof(HopByHopFields[0]);
+
+/**
+ * Create relay of CGI output for request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Pipe (or worker socket) of CGI output.
+ * @param   input       Pipe (or worker socket) of CGI input (-1 if the
+ * request has no body).
+ * @return  Newly allocated Relay structure (or NULL on error).
+ *
+ * Everything the relay needs to know about the request is recorded, so the
+ * relay can outlive it (see event.c).
+ *
+ * The returned relay must be deallocated with relay_free (which closes fd
+ * and input).
+ **/
+Relay * relay_create(Request *r, int fd, int input) {
+    struct stat sb;
+
+    Relay *relay = calloc(1, sizeof(Relay));
+    if (!relay) {
+        debug("Unable to allocate relay: %s", strerror(errno));
+        return NULL;
+    }
+
+    relay->fd         = fd;
+    relay->input      = input;
+    relay->pipe       = fstat(fd, &sb) == 0 && S_ISFIFO(sb.st_mode);
+    relay->http11     = streq(request_string(r, r->version), "HTTP/1.1");
+    relay->body       = !r->head;
+    relay->keep_alive = r->keep_alive;
+    relay->remaining  = -1;
+    return relay;
+}
+
+/**
+ * Deallocate relay (closing the CGI output and input).
+ *
+ * @param   relay       Relay structure.
+ **/
+void relay_free(Relay *relay) {
+    if (relay) {
+        if (relay->input >= 0) {
+            close(relay->input);
+        }
+        close(relay->fd);
+        free(relay);
+    }
+}
+
+/**
+ * Locate end of CGI header.
+ *
+ * @param   relay       Relay structure.
+ * @param   nlines      Pointer to store length of header lines in.
+ * @return  Offset of body (or 0 if the header is not complete yet).
+ **/
+static size_t relay_header_end(Relay *relay, size_t *nlines) {
+    for (size_t i = 0; i + 1 < relay->nheader; i++) {
+        if (relay->header[i] != '\n') {
+            continue;
+        }
+        if (relay->header[i + 1] == '\n') {
+            *nlines = i + 1;
+            return i + 2;
+        }
+        if (relay->header[i + 1] == '\r' && i + 2 < relay->nheader && relay->header[i + 2] == '\n') {
+            *nlines = i + 1;
+            return i + 3;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read CGI header and build response header from it.
+ *
+ * @param   relay       Relay structure.
+ * @param   response    Response structure to build header in.
+ * @return  -1 on error, 0 once the response header is complete, and 1 if
+ * more output is needed (only for non-blocking output).
+ *
+ * The script's header ends at the first blank line.  Its status comes from
+ * a leading status line (as the scripts in www/scripts print) or a Status
+ * field, and defaults to 200 OK (or 302 Found with a Location field).  The
+ * remaining fields are passed on, except the ones describing the script's
+ * own connection.
+ *
+ * The body is then delimited by the script's Content-Length if it gave one,
+ * and otherwise sent in chunks to HTTP/1.1 clients, so the connection can
+ * persist either way.  Only if neither is possible must the connection close.
+ * An invalid (or conflicting) Content-Length is dropped and the body is
+ * delimited by closing the connection, since the script's output cannot be
+ * trusted to match any length.
+ **/
+int relay_header(Relay *relay, Response *response) {
+    char lines[BUFSIZ];
+    size_t nlines = 0;
+    size_t offset;
+
+    /* Read until blank line */
+    while (!(offset = relay_header_end(relay, &nlines))) {
+        if (relay->nheader == sizeof(relay->header)) {
+            debug("CGI header does not fit in %zu bytes", sizeof(relay->header));
+            return -1;
+        }
+
+        ssize_t n = read(relay->fd, relay->header + relay->nheader, sizeof(relay->header) - relay->nheader);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (n <= 0) {
+            debug("CGI output ended before header: %s", n < 0 ? strerror(errno) : "end of output");
+            return -1;
+        }
+        relay->nheader += n;
+    }
+
+    memcpy(lines, relay->header, nlines);
+    lines[nlines] = '\0';
+    relay->noffset = offset;
+
+    /* Parse status and fields */
+    struct {
+        const char *name;
+        const char *value;
+    } fields[RELAY_FIELDS];
+    size_t nfields     = 0;
+    const char *status = NULL;
+    bool   location    = false;
+    bool   invalid     = false;
+    char  *cursor      = lines;
+
+    for (char *line = strsep(&cursor, "\n"); line; line = strsep(&cursor, "\n")) {
+        line[strcspn(line, "\r")] = '\0';
+        if (!*line) {
+            continue;
+        }
+
+        if (line == lines && strncmp(line, "HTTP/", 5) == 0) {
+            status = skip_whitespace(skip_nonwhitespace(line));
+            continue;
+        }
+
+        char *colon = strchr(line, ':');
+        if (!colon) {
+            debug("Malformed CGI header line: %s", line);
+            return -1;
+        }
+        *colon = '\0';
+        char *value = skip_whitespace(colon + 1);
+
+        if (strcasecmp(line, "Status") == 0) {
+            status = value;
+            continue;
+        }
+
+        bool hop = false;
+        for (size_t i = 0; i < NHopByHopFields; i++) {
+            hop = hop || strcasecmp(line, HopByHopFields[i]) == 0;
+        }
+        if (hop) {
+            continue;
+        }
+
+        /* Content-Length is added once it is known to be valid */
+        if (strcasecmp(line, "Content-Length") == 0) {
+            char *end;
+            errno = 0;
+            off_t length = strtoll(value, &end, 10);
+            if (!isdigit((unsigned char)*value) || *end || errno == ERANGE ||
+                (relay->remaining >= 0 && length != relay->remaining)) {
+                debug("Invalid CGI Content-Length: %s", value);
+                invalid = true;
+            }
+            relay->remaining = length;
+            continue;
+        } else if (strcasecmp(line, "Location") == 0) {
+            location = true;
+        }
+
+        if (nfields == RELAY_FIELDS) {
+            debug("Too many CGI header fields");
+            return -1;
+        }
+        fields[nfields].name  = line;
+        fields[nfields].value = value;
+        nfields++;
+    }
+
+    if (!status) {
+        status = location ? "302 Found" : "200 OK";
+    }
+    if (strspn(status, "0123456789") != 3 || (status[3] && status[3] != ' ')) {
+        debug("Invalid CGI status: %s", status);
+        return -1;
+    }
+
+    /* Informational, No Content, and Not Modified responses have no body */
+    if (status[0] == '1' || strncmp(status, "204", 3) == 0 || strncmp(status, "304", 3) == 0) {
+        relay->body = false;
+    }
+
+    /* Determine how body is delimited */
+    if (invalid) {
+        relay->remaining  = -1;
+        relay->keep_alive = false;
+    }
+    relay->chunked = relay->body && relay->remaining < 0 && relay->http11 && relay->keep_alive;
+    if (relay->body && relay->remaining < 0 && !relay->chunked) {
+        relay->keep_alive = false;
+    }
+    relay->finished = !relay->body;
+    relay->started  = true;
+
+    /* Build response header */
+    response_start_status(response, status);
+    for (size_t i = 0; i < nfields; i++) {
+        response_field(response, fields[i].name, "%s", fields[i].value);
+    }
+    if (relay->remaining >= 0) {
+        response_field(response, "Content-Length", "%jd", (intmax_t)relay->remaining);
+    }
+    if (relay->chunked) {
+        response_field(response, "Transfer-Encoding", "chunked");
+    }
+    return response_finish(response, relay->keep_alive);
+}
+
+/**
+ * Read next piece of body (framed as a chunk if chunked).
+ *
+ * @param   relay       Relay structure.
+ * @param   buffer      Buffer to store piece in.
+ * @param   size        Size of buffer (more than RELAY_FRAME).
+ * @return  Length of piece (0 once the body is finished, and -1 on error,
+ * i.e. EAGAIN if no output is available yet).
+ *
+ * Any body read along with the header comes first.  The body is cut off at
+ * the script's Content-Length; if the script ends before that, the connection
+ * cannot persist.  The last piece of a chunked body is the final chunk.
+ *
+ * The chunk size is written with a fixed number of digits, so the output can
+ * be read right after the chunk header.
+ **/
+ssize_t relay_read(Relay *relay, char *buffer, size_t size) {
+    size_t nframe = relay->chunked ? 8 : 0;
+    size_t nwant  = size - RELAY_FRAME;
+    ssize_t n;
+
+    if (relay->finished) {
+        return 0;
+    }
+
+    if (relay->remaining >= 0 && (off_t)nwant > relay->remaining) {
+        nwant = relay->remaining;
+    }
+
+    if (nwant == 0) {
+        n = 0;
+    } else if (relay->noffset < relay->nheader) {
+        n = relay->nheader - relay->noffset < nwant ? relay->nheader - relay->noffset : nwant;
+        memcpy(buffer + nframe, relay->header + relay->noffset, n);
+        relay->noffset += n;
+    } else if ((n = read(relay->fd, buffer + nframe, nwant)) < 0) {
+        return -1;
+    }
+
+    if (n == 0) {
+        relay->finished = true;
+        if (relay->remaining > 0) {
+            debug("CGI output ended %jd bytes short", (intmax_t)relay->remaining);
+            relay->keep_alive = false;
+        }
+        if (relay->chunked) {
+            memcpy(buffer, "0\r\n\r\n", 5);
+            return 5;
+        }
+        return 0;
+    }
+
+    if (relay->remaining > 0) {
+        relay->remaining -= n;
+    }
+
+    if (relay->chunked) {
+        char frame[32];
+        snprintf(frame, sizeof(frame), "%06zx\r\n", (size_t)n);
+        memcpy(buffer, frame, nframe);
+        memcpy(buffer + nframe + n, "\r\n", 2);
+        return nframe + n + 2;
+    }
+    return n;
+}
+
+/**
+ * Start splicing available output.
+ *
+ * @param   relay       Relay structure.
+ * @param   frame       Buffer of RELAY_FRAME bytes to store chunk header in.
+ * @param   nframe      Pointer to store length of chunk header in (0 if the
+ * body is not chunked).
+ * @return  Number of bytes to splice from the pipe (0 if splicing is not
+ * possible right now, in which case relay_read should be used).
+ *
+ * Only output already in the pipe is spliced, so the chunk size is known up
+ * front.  The caller sends the chunk header, then splices relay->nsplice
+ * bytes, and then ends the chunk with CRLF.
+ **/
+size_t relay_splice_start(Relay *relay, char *frame, size_t *nframe) {
+    int navailable = 0;
+
+    if (!relay->pipe || relay->finished || relay->noffset < relay->nheader || relay->remaining == 0 ||
+        ioctl(relay->fd, FIONREAD, &navailable) < 0 || navailable <= 0) {
+        return 0;
+    }
+
+    size_t n = navailable < RELAY_SIZE ? navailable : RELAY_SIZE;
+    if (relay->remaining > 0) {
+        if ((off_t)n > relay->remaining) {
+            n = relay->remaining;
+        }
+        relay->remaining -= n;
+    }
+
+    *nframe = relay->chunked ? (size_t)snprintf(frame, RELAY_FRAME, "%zx\r\n", n) : 0;
+    relay->nsplice = n;
+    return n;
+}
+
+/**
+ * Relay next piece of CGI response to blocking client socket.
+ *
+ * @param   relay       Relay structure.
+ * @param   r           HTTP Request structure.
+ * @return  -1 on error (i.e. EAGAIN if no output is available yet, and
+ * EBADMSG if the CGI header is invalid) and 0 on success.
+ *
+ * The first piece is the response header, once the CGI header is complete.
+ * After that, output already in the pipe is spliced straight into the
+ * socket, so it never passes through user space; anything else (i.e. the
+ * output of a pooled worker, which is a socket) is copied through a buffer.
+ **/
+static int relay_step(Relay *relay, Request *r) {
+    FILE *stream = r->connection->stream;
+    int sfd = fileno(stream);
+    char buffer[BUFSIZ + RELAY_FRAME];
+    char frame[RELAY_FRAME];
+    size_t nframe;
+    ssize_t n;
+
+    if (!relay->started) {
+        Response response;
+        int status = relay_header(relay, &response);
+        if (status != 0) {
+            errno = status > 0 ? EAGAIN : EBADMSG;
+            return -1;
+        }
+
+        struct iovec iov = {response.data, response.length};
+        return response_write(r, &iov, 1);
+    }
+
+    if (relay->nsplice > 0) {
+        if (fflush(stream) != 0) {
+            return -1;
+        }
+        if ((n = splice(relay->fd, NULL, sfd, NULL, relay->nsplice, SPLICE_F_MOVE)) <= 0) {
+            errno = n < 0 ? errno : EPIPE;
+            return -1;
+        }
+        relay->nsplice -= n;
+        r->nsent += n;
+
+        if (relay->nsplice == 0 && relay->chunked && fputs("\r\n", stream) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (sfd >= 0 && relay_splice_start(relay, frame, &nframe) > 0) {
+        return fwrite(frame, 1, nframe, stream) == nframe ? 0 : -1;
+    }
+
+    if ((n = relay_read(relay, buffer, sizeof(buffer))) < 0 || fwrite(buffer, 1, n, stream) != (size_t)n) {
+        return -1;
+    }
+    r->nsent += n;
+    return 0;
+}
+
+/**
+ * Send request body to CGI input, while relaying any CGI response.
+ *
+ * @param   relay       Relay structure.
+ * @param   r           HTTP Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * The body is passed on piece by piece as it arrives (see
+ * request_body_buffered), so uploads of any size only ever take a connection
+ * buffer.  The input is closed once the whole body is sent.
+ *
+ * Scripts may write output before they have read all of their input (i.e.
+ * echo the body back), so the CGI output is relayed to the client as soon
+ * as it is available (see relay_step), rather than only once the body is
+ * sent: otherwise, both pipes could fill up with each side waiting for the
+ * other.  To wait for either, both are made non-blocking until the body is
+ * sent.  Only waiting for the client is bounded by KeepAliveTimeout.
+ *
+ * A script that exits without reading all of the body is not an error, but
+ * relay->keep_alive is cleared, since the rest of the body is left in the
+ * stream.
+ *
+ * On error, errno is EFBIG if the body is larger than MaxBodySize, and
+ * EBADMSG if the CGI header is invalid.  If relay->started is set, then part
+ * of the response has been sent already.
+ **/
+int relay_upload(Relay *relay, Request *r) {
+    Connection *connection = r->connection;
+    int timeout = KeepAliveTimeout > 0 ? KeepAliveTimeout * 1000 : -1;
+    const char *data;
+    ssize_t n;
+
+    if (socket_nonblocking(relay->fd, true) < 0 || socket_nonblocking(relay->input, true) < 0) {
+        return -1;
+    }
+
+    while ((n = request_body_buffered(r, &data)) != 0) {
+        if (n < 0 && errno != EAGAIN) {
+            return -1;
+        }
+
+        /* Wait for room in the CGI input (or more of the body), or output */
+        struct pollfd fds[] = {
+            {n > 0 ? relay->input : connection->fd, n > 0 ? POLLOUT : POLLIN, 0},
+            {relay->finished && !relay->nsplice ? -1 : relay->fd, POLLIN, 0},
+        };
+
+        int ready = poll(fds, 2, n > 0 ? -1 : timeout);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            errno = ready < 0 ? errno : ETIMEDOUT;
+            return -1;
+        }
+
+        if (fds[1].revents) {
+            if (relay_step(relay, r) < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+            if (fflush(connection->stream) != 0) {
+                return -1;
+            }
+        }
+
+        if (!fds[0].revents) {
+            continue;
+        }
+
+        if (n < 0) {
+            if ((n = connection_fill(connection)) <= 0) {
+                errno = n < 0 ? errno : ECONNRESET;
+                return -1;
+            }
+            continue;
+        }
+
+        n = write(relay->input, data, n);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n < 0 && errno == EPIPE) {
+            debug("CGI script stopped reading request body");
+            relay->keep_alive = false;
+            break;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        request_body_consume(r, n);
+    }
+
+    close(relay->input);
+    relay->input = -1;
+    return socket_nonblocking(relay->fd, false);
+}
+
+/**
+ * Relay CGI response to blocking client socket.
+ *
+ * @param   relay       Relay structure.
+ * @param   r           HTTP Request structure.
+ * @return  -1 if the CGI header is invalid (and nothing was sent) and 0
+ * otherwise.
+ *
+ * The response is relayed piece by piece (see relay_step), picking up
+ * wherever relay_upload left off, so the body is relayed byte for byte.
+ *
+ * If the response cannot be sent completely, then relay->keep_alive is
+ * cleared.
+ **/
+int relay_send(Relay *relay, Request *r) {
+    while (!relay->finished || relay->nsplice) {
+        if (relay_step(relay, r) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!relay->started) {
+                return -1;
+            }
+            debug("Unable to relay CGI output: %s", strerror(errno));
+            relay->keep_alive = false;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
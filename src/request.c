@@ -2,70 +2,110 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
 #include <unistd.h>
 
-int parse_request_method(Request *r);
-int parse_request_headers(Request *r);
+/* Constants */
+
+#define REQUEST_FREELIST_MAX    16      /* Requests kept for reuse per thread */
+#define HEXDIGITS               "0123456789abcdefABCDEF"    /* Digits of chunk size */
+
+/* Global Variables */
+
+static __thread Request *FreeRequests  = NULL;  /* Recycled requests */
+static __thread size_t   NFreeRequests = 0;     /* Length of freelist */
+
+/**
+ * Perfect hash of header name (see HeaderNames)
+ */
+#define HEADER_SLOT(length, first, last) \
+    (((length) + 7 * ((first) | 0x20) + ((last) | 0x20)) % HEADER_SLOTS)
+
+#define HEADER_SLOTS    32
+
+static const struct {
+    const char *name;
+    HeaderName  header;
+} HeaderNames[HEADER_SLOTS] = {     /* Known headers by HEADER_SLOT */
+    [HEADER_SLOT( 6, 'a', 't')] = {"Accept",            HEADER_ACCEPT},
+    [HEADER_SLOT(15, 'a', 'g')] = {"Accept-Encoding",   HEADER_ACCEPT_ENCODING},
+    [HEADER_SLOT(15, 'a', 'e')] = {"Accept-Language",   HEADER_ACCEPT_LANGUAGE},
+    [HEADER_SLOT(10, 'c', 'n')] = {"Connection",        HEADER_CONNECTION},
+    [HEADER_SLOT(14, 'c', 'h')] = {"Content-Length",    HEADER_CONTENT_LENGTH},
+    [HEADER_SLOT(12, 'c', 'e')] = {"Content-Type",      HEADER_CONTENT_TYPE},
+    [HEADER_SLOT( 6, 'c', 'e')] = {"Cookie",            HEADER_COOKIE},
+    [HEADER_SLOT( 4, 'h', 't')] = {"Host",              HEADER_HOST},
+    [HEADER_SLOT(17, 'i', 'e')] = {"If-Modified-Since", HEADER_IF_MODIFIED_SINCE},
+    [HEADER_SLOT(13, 'i', 'h')] = {"If-None-Match",     HEADER_IF_NONE_MATCH},
+    [HEADER_SLOT( 8, 'i', 'e')] = {"If-Range",          HEADER_IF_RANGE},
+    [HEADER_SLOT( 5, 'r', 'e')] = {"Range",             HEADER_RANGE},
+    [HEADER_SLOT( 7, 'r', 'r')] = {"Referer",           HEADER_REFERER},
+    [HEADER_SLOT(17, 't', 'g')] = {"Transfer-Encoding", HEADER_TRANSFER_ENCODING},
+    [HEADER_SLOT(10, 'u', 't')] = {"User-Agent",        HEADER_USER_AGENT},
+};
 
 /**
- * Accept request from server socket.
+ * Determine which known header a name is.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   name        Name of header (case-insensitive).
+ * @param   length      Length of name.
+ * @return  Known header (or HEADER_UNKNOWN).
+ *
+ * The length, first, and last characters of every known name hash to a
+ * distinct slot, so a single comparison decides the lookup.
+ **/
+static HeaderName header_lookup(const char *name, size_t length) {
+    if (length == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    size_t slot = HEADER_SLOT(length, (unsigned char)name[0], (unsigned char)name[length - 1]);
+    const char *known = HeaderNames[slot].name;
+    if (known && strlen(known) == length && strncasecmp(known, name, length) == 0) {
+        return HeaderNames[slot].header;
+    }
+    return HEADER_UNKNOWN;
+}
+
+/**
+ * Create request for connection.
+ *
+ * @param   connection  Connection the request arrives on.
  * @return  Newly allocated Request structure.
  *
- * This function does the following:
+ * Any data still buffered from earlier requests is discarded first, so the
+ * new request starts at the front of the connection buffer and can be parsed
+ * in place for its whole lifetime.  Likewise, the connection arena is reset,
+ * so it only holds allocations of the new request.
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ * Requests are recycled through a per-thread freelist, so a busy server does
+ * not go through malloc for every request.
  *
- * The returned request struct must be deallocated using free_request.
+ * The returned request struct must be deallocated using free_request (which
+ * does not close the connection).
  **/
-Request * accept_request(int sfd) {
-
-    /* Allocate request struct (zeroed) */
-    Request *r = calloc(1, sizeof(Request));
-    if ( !r ) {
+Request * create_request(Connection *connection) {
+    Request *r = FreeRequests;
+
+    if (r) {
+        FreeRequests = r->next;
+        NFreeRequests--;
+        memset(r, 0, sizeof(Request));
+    } else if (!(r = calloc(1, sizeof(Request)))) {
         debug("Unable to allocate request: %s", strerror(errno));
         return NULL;
     }
 
-    /* Accept a client */
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
-    r->fd = accept(sfd, &raddr, &rlen); 
-    if (r->fd < 0) {
-        debug("Unable to accept: %s", strerror(errno));
-        goto fail;
-    }
-
-    /* Lookup client information */
-    int status = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
-    if (status < 0) {
-        debug("Unable to accept: %s", gai_strerror(status));
-        goto fail;
-    }
-
-    /* Open socket stream */
-    r->stream = fdopen(r->fd, "w+");
-    if ( !r->stream) {
-        debug("Unable to fdopen: %s", strerror(errno));
-        goto fail;
-    }
-
-    log("Accepted request from %s:%s", r->host, r->port);
+    connection_compact(connection);
+    arena_reset(&connection->arena);
+    r->connection = connection;
+    r->nparsed    = connection->noffset;
+    r->fd         = -1;
     return r;
-
-fail:
-    /* Deallocate request struct */
-    free_request(r);
-    return NULL;
 }
 
 /**
@@ -73,48 +113,57 @@ fail:
  *
  * @param   r           Request structure.
  *
- * This function does the following:
+ * This closes the file opened for the request and returns the request struct
+ * to the freelist (or frees it if the freelist is full).  Its fields all
+ * point into the connection buffer or arena, so there is nothing else to
+ * free.
  *
- *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ * The connection of the request is left open.
  **/
 void free_request(Request *r) {
-    log("Entered Free Request");
+    debug("Entered Free Request");
     if (!r) {
     	return;
     }
 
-    /* Close socket or fd */
-    if ( r->stream )
-        fclose(r->stream);
-
-    /* Free allocated strings */
-    if ( r->method )
-        free(r->method);
-    if ( r->uri )
-        free(r->uri);
-    if ( r->query )
-        free(r->query);
-    if ( r->path )
-        free(r->path);
-
-    /* Free headers */
-    Header *h = r->headers;
-    Header *curr;
-    while (h) {
-        if ( h->name )
-            free(h->name);
-        if ( h->data )
-            free(h->data);
-        curr = h;
-        h = h->next;
-        free(curr);
+    /* Close requested file */
+    if ( r->fd >= 0 )
+        close(r->fd);
+
+    /* Recycle request */
+    if (NFreeRequests < REQUEST_FREELIST_MAX) {
+        r->next      = FreeRequests;
+        FreeRequests = r;
+        NFreeRequests++;
+    } else {
+        free(r);
     }
-    
-    /* Free request */
-    free(r);
+}
+
+/**
+ * Return request field as string.
+ *
+ * @param   r           Request structure.
+ * @param   s           Slice of field in connection buffer.
+ * @return  NUL-terminated field (valid until the request is freed).
+ **/
+const char * request_string(Request *r, Slice s) {
+    return r->connection->buffer + s.offset;
+}
+
+/**
+ * Lookup known request header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Known header.
+ * @return  Data of first such header (or NULL if not present).
+ **/
+const char * request_header(Request *r, HeaderName name) {
+    /* Header data always follows the request line, so offset 0 is unset */
+    if (name >= HEADER_UNKNOWN || r->known[name].offset == 0) {
+        return NULL;
+    }
+    return request_string(r, r->known[name]);
 }
 
 /**
@@ -123,25 +172,130 @@ void free_request(Request *r) {
  * @param   r           Request structure.
  * @return  -1 on error and 0 on success.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This parses the request (see parse_request_buffered), reading more data
+ * from the connection whenever the buffered data ends before the request
+ * header does.
+ *
+ * On success, it also determines whether the connection should persist after
+ * the response: HTTP/1.1 connections persist unless the client sends
+ * "Connection: close", while HTTP/1.0 connections only persist if the client
+ * sends "Connection: keep-alive".  The body that follows the header (if any)
+ * is left in the stream to be read by the handler (see
+ * request_body_buffered).
  **/
+static int parse_request_body(Request *r);
+
 int parse_request(Request *r) {
-    log("Entered Parse Request");
-    /* Parse HTTP Request Method */
-    if (parse_request_method(r) < 0)
+    debug("Entered Parse Request");
+    int status;
+
+    while ((status = parse_request_buffered(r)) > 0) {
+        if (connection_fill(r->connection) <= 0) {
+            debug("Unable to read request: %s", strerror(errno));
+            r->state = REQUEST_ERROR;
+            return -1;
+        }
+    }
+    if (status < 0) {
         return -1;
+    }
+
+    /* Determine connection persistence */
+    const char *connection = request_header(r, HEADER_CONNECTION);
+    r->keep_alive = KeepAliveTimeout > 0 && streq(request_string(r, r->version), "HTTP/1.1");
+    if (connection && strcasestr(connection, "close"))
+        r->keep_alive = false;
+    else if (connection && strcasestr(connection, "keep-alive"))
+        r->keep_alive = KeepAliveTimeout > 0;
+
+    return parse_request_body(r);
+}
+
+/**
+ * Determine how request body is delimited.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * A body is either sent in chunks ("Transfer-Encoding: chunked") or
+ * delimited by Content-Length.  A request with both is an error rather than
+ * picking one, since a proxy in front of the server may have picked the
+ * other and would then disagree about where the next request starts.  Any
+ * other transfer coding is an error too, since the end of the body could
+ * not be found.
+ **/
+static int parse_request_body(Request *r) {
+    const char *encoding = request_header(r, HEADER_TRANSFER_ENCODING);
+    const char *length   = request_header(r, HEADER_CONTENT_LENGTH);
 
-    /* Parse HTTP Requet Headers*/
-    if (parse_request_headers(r) < 0)
+    if (encoding && length) {
+        debug("Both Transfer-Encoding and Content-Length given");
         return -1;
+    }
+
+    if (encoding) {
+        if (strcasecmp(encoding, "chunked") != 0) {
+            debug("Unsupported transfer coding: %s", encoding);
+            return -1;
+        }
+        r->chunked = true;
+        r->body    = BODY_CHUNK;
+    } else if (length) {
+        char *end;
+        errno = 0;
+        r->nbody = strtoll(length, &end, 10);
+        if (!isdigit((unsigned char)*length) || *end || errno == ERANGE) {
+            debug("Invalid Content-Length: %s", length);
+            return -1;
+        }
+        r->nremaining = r->nbody;
+        r->body       = r->nbody > 0 ? BODY_DATA : BODY_NONE;
+    }
+
+    /* Only HTTP/1.1 clients wait for permission to send the body */
+    for (size_t i = 0; i < r->nunknown && r->body != BODY_NONE; i++) {
+        if (strcasecmp(request_string(r, r->unknown[i].name), "Expect") == 0) {
+            r->expect_continue = strcasecmp(request_string(r, r->unknown[i].data), "100-continue") == 0 &&
+                                 streq(request_string(r, r->version), "HTTP/1.1");
+        }
+    }
     return 0;
 }
 
+/**
+ * Record next whitespace delimited token of line as slice.
+ *
+ * @param   buffer      Connection buffer.
+ * @param   offset      Pointer to offset to scan from (advanced past token).
+ * @param   end         Offset of end of line.
+ * @param   s           Slice to record token in.
+ * @return  Whether or not a token was found.
+ *
+ * The token is terminated in place.
+ **/
+static bool parse_token(char *buffer, size_t *offset, size_t end, Slice *s) {
+    while (*offset < end && strchr(WHITESPACE, buffer[*offset])) {
+        (*offset)++;
+    }
+
+    s->offset = *offset;
+    while (*offset < end && !strchr(WHITESPACE, buffer[*offset])) {
+        (*offset)++;
+    }
+    s->length = *offset - s->offset;
+
+    if (*offset < end) {
+        buffer[(*offset)++] = '\0';
+    }
+    return s->length > 0;
+}
+
 /*
  * Parse HTTP Request Method and URI.
  *
  * @param   r           Request structure.
+ * @param   start       Offset of request line.
+ * @param   end         Offset of end of request line (already terminated).
  * @return  -1 on error and 0 on success.
  *
  * HTTP Requests come in the form
@@ -153,60 +307,45 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function records the method, uri, query (empty if it does not exist),
+ * and version (empty, meaning HTTP/1.0, if it does not exist), and whether
+ * the response is just a header (HEAD).
  **/
-int parse_request_method(Request *r) {
-    log("Entered Parse Request Method");
-    char buffer[BUFSIZ];
-    char *method;
-    char *uri;
-    char *query;
-
-    /* Read line from socket */
-    if (!fgets(buffer, BUFSIZ, r->stream) ) {
-        debug("Unable to read line from socket: %s", strerror(errno));
-        goto fail;
-    }
+static int parse_request_method(Request *r, size_t start, size_t end) {
+    char *buffer = r->connection->buffer;
 
     /* Parse method and uri */
-    method = strtok(buffer, WHITESPACE);
-    uri    = strtok(NULL  , WHITESPACE);
-
-    if ( !method || !uri ) {
+    if ( !parse_token(buffer, &start, end, &r->method) || !parse_token(buffer, &start, end, &r->uri) ) {
         debug("Unable to parse method and uri");
-        goto fail;
+        return -1;
     }
+    parse_token(buffer, &start, end, &r->version);
+    r->head = streq(request_string(r, r->method), "HEAD");
 
     /* Parse query from uri */
-    query = strchr(uri,'?');
+    char *query = memchr(buffer + r->uri.offset, '?', r->uri.length);
     if ( !query ) {
-        query = "";
+        r->query = (Slice){r->uri.offset + r->uri.length, 0};
     } else {
         *(query++) = '\0';
+        r->query.offset = query - buffer;
+        r->query.length = r->uri.offset + r->uri.length - r->query.offset;
+        r->uri.length   = query - 1 - (buffer + r->uri.offset);
     }
 
-    /* Record method, uri, and query in request struct */
-    r->method = strdup(method);
-    r->uri = strdup(uri);
-    r->query = strdup(query);
-    if ( !(r->method) || !(r->uri) || !(r->query) ) {
-        debug("Failed to alocate memory: %s", strerror(errno));
-        goto fail;
-    }
-    debug("HTTP METHOD: %s", r->method);
-    debug("HTTP URI:    %s", r->uri);
-    debug("HTTP QUERY:  %s", r->query);
-
+    debug("HTTP METHOD: %s", request_string(r, r->method));
+    debug("HTTP URI:    %s", request_string(r, r->uri));
+    debug("HTTP QUERY:  %s", request_string(r, r->query));
+    debug("HTTP VERSION: %s", request_string(r, r->version));
     return 0;
-
-fail:
-    return -1;
 }
 
 /**
- * Parse HTTP Request Headers.
+ * Parse HTTP Request Header.
  *
  * @param   r           Request structure.
+ * @param   start       Offset of header line.
+ * @param   end         Offset of end of header line (already terminated).
  * @return  -1 on error and 0 on success.
  *
  * HTTP Headers come in the form:
@@ -222,59 +361,238 @@ fail:
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
- * This function parses the stream from the request socket using the following
- * pseudo-code:
+ * The data (without surrounding whitespace) of well-known headers is recorded
+ * in the request's known array, indexed by HeaderName, so looking them up
+ * later is O(1).  The name and data of any other header are recorded in the
+ * next free entry of the request's unknown array.
+ **/
+static int parse_request_header(Request *r, size_t start, size_t end) {
+    char *buffer = r->connection->buffer;
+
+    char *data = memchr(buffer + start, ':', end - start);
+    if ( !data ) {
+        debug("Unable to find : in the header");
+        return -1;
+    }
+
+    Slice name = {start, data - (buffer + start)};
+    *(data++) = '\0';
+
+    size_t offset = data - buffer;
+    while (offset < end && strchr(WHITESPACE, buffer[offset])) {
+        offset++;
+    }
+    while (end > offset && strchr(WHITESPACE, buffer[end - 1])) {
+        buffer[--end] = '\0';
+    }
+    Slice value = {offset, end - offset};
+
+    /* Record known header (keeping the first occurrence) or other header.
+     * Repeated body framing headers are rejected, since another reader of
+     * the request may honor a different occurrence. */
+    HeaderName known = header_lookup(buffer + start, name.length);
+    if ( known != HEADER_UNKNOWN ) {
+        if ( r->known[known].offset != 0 && (known == HEADER_CONTENT_LENGTH || known == HEADER_TRANSFER_ENCODING) ) {
+            debug("Repeated %s header", buffer + start);
+            return -1;
+        }
+        if ( r->known[known].offset == 0 ) {
+            r->known[known] = value;
+        }
+    } else if ( r->nunknown == REQUEST_MAX_HEADERS ) {
+        debug("Too many headers");
+        return -1;
+    } else {
+        r->unknown[r->nunknown++] = (Header){name, value};
+    }
+
+    debug("HTTP HEADER %s = %s", request_string(r, name), request_string(r, value));
+    return 0;
+}
+
+/**
+ * Parse as much of HTTP Request as is buffered.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error, 0 once the request header is complete, and 1 if more
+ * data is needed.
  *
- *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, data  = buffer.split(':')
- *      header      = new Header(name, data)
- *      headers.append(header)
+ * The request line and header lines are parsed in place: each field is
+ * terminated inside the connection buffer and recorded as an (offset, length)
+ * slice, so nothing is allocated.  Parsing resumes where it left off when
+ * called again after more data arrives, which allows it to be driven by
+ * non-blocking reads.
+ *
+ * A request header that does not fit in the connection buffer is an error.
  **/
-int parse_request_headers(Request *r) {
-    log("Entered Parse Request Headers");
-    Header *curr = NULL;
-    char buffer[BUFSIZ];
-    char *name;
-    char *data;
-
-    /* Parse headers from socket */
-    while ( fgets(buffer, BUFSIZ, r->stream) && strlen(buffer) > 2 ) {
-
-        data = strchr(buffer,':');
-        if ( !data ) {
-            debug("Unable to find : in the header");
-            goto fail;
+int parse_request_buffered(Request *r) {
+    Connection *c = r->connection;
+
+    if (r->state == REQUEST_DONE || r->state == REQUEST_ERROR) {
+        return r->state == REQUEST_DONE ? 0 : -1;
+    }
+
+    while (r->state == REQUEST_METHOD || r->state == REQUEST_HEADERS) {
+        size_t start  = r->nparsed;
+        char *newline = memchr(c->buffer + start, '\n', c->nbuffer - start);
+        if ( !newline ) {
+            if (c->nbuffer == sizeof(c->buffer)) {
+                debug("Request header too large");
+                r->state = REQUEST_ERROR;
+                break;
+            }
+            return 1;
         }
-        *(data++) = '\0';
-        data = skip_whitespace(data);
-        chomp(data);
-        name = buffer;
-
-        curr = calloc(1, sizeof(Header));
-        if ( !curr ) {
-            debug("Unable to allocate a header: %s", strerror(errno));
-            goto fail;
+
+        /* Terminate line (without its CRLF or LF) */
+        size_t end = newline - c->buffer;
+        r->nparsed = end + 1;
+        if (end > start && c->buffer[end - 1] == '\r') {
+            end--;
         }
-        curr->name = strdup(name);
-        curr->data = strdup(data);
-        if ( !(curr->name) || !(curr->data) ) {
-            debug("Unable to allocate header info: %s", strerror(errno));
-            goto fail;
+        c->buffer[end] = '\0';
+
+        if (r->state == REQUEST_METHOD) {
+            r->state = parse_request_method(r, start, end) < 0 ? REQUEST_ERROR : REQUEST_HEADERS;
+        } else if (end == start) {
+            r->state = REQUEST_DONE;
+        } else if (parse_request_header(r, start, end) < 0) {
+            r->state = REQUEST_ERROR;
         }
-        curr->next = r->headers;
-        r->headers = curr;
-        
     }
 
-#ifndef NDEBUG
-    for (Header *header = r->headers; header; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->data);
+    /* Consume request header from connection buffer */
+    c->noffset = r->nparsed;
+    return r->state == REQUEST_DONE ? 0 : -1;
+}
+
+/**
+ * Locate next piece of request body in connection buffer.
+ *
+ * @param   r           Request structure.
+ * @param   data        Pointer to store start of piece in.
+ * @return  Length of piece, 0 once the whole body has been read, and -1 on
+ * error.
+ *
+ * The body is read through the connection buffer right behind the request
+ * header, so at most a buffer of it is held at a time however large it is.
+ * Chunk framing is skipped, so only body data is ever returned, and pieces
+ * must be consumed (see request_body_consume) before the next is located.
+ *
+ * If nothing of the body is buffered, then -1 is returned with errno set to
+ * EAGAIN: once room is made for more, the caller must read more into the
+ * buffer (see connection_fill) and try again.  A chunk that would make the
+ * body larger than MaxBodySize is an error with errno set to EFBIG, and any
+ * other malformed chunk one with errno set to EPROTO.  Chunk sizes are only
+ * hex digits (no sign, whitespace, or 0x prefix, which strtoll would allow).
+ **/
+ssize_t request_body_buffered(Request *r, const char **data) {
+    Connection *c = r->connection;
+
+    while (r->body != BODY_NONE) {
+        char  *line = c->buffer + c->noffset;
+        size_t n    = c->nbuffer - c->noffset;
+
+        if (r->body == BODY_ERROR) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        if (r->body == BODY_DATA) {
+            if (n == 0) {
+                break;
+            }
+            *data = line;
+            return (off_t)n < r->nremaining ? (ssize_t)n : (ssize_t)r->nremaining;
+        }
+
+        /* Parse next chunk size, line end, or trailer line */
+        char *end = memchr(line, '\n', n);
+        if (!end) {
+            break;
+        }
+        c->noffset += end + 1 - line;
+
+        bool empty = end == line || (end == line + 1 && line[0] == '\r');
+        if (r->body == BODY_CHUNK_END) {
+            r->body = empty ? BODY_CHUNK : BODY_ERROR;
+        } else if (r->body == BODY_TRAILERS) {
+            r->body = empty ? BODY_NONE : BODY_TRAILERS;
+        } else {
+            char *rest;
+            errno = 0;
+            long long size = strtoll(line, &rest, 16);
+            if (!isxdigit((unsigned char)*line) || rest != line + strspn(line, HEXDIGITS) ||
+                errno == ERANGE || !*rest || !strchr("; \t\r\n", *rest)) {
+                debug("Invalid chunk size");
+                r->body = BODY_ERROR;
+            } else if (size > MaxBodySize - r->nbody) {
+                debug("Request body too large");
+                r->body = BODY_ERROR;
+                errno   = EFBIG;
+                return -1;
+            } else {
+                r->nbody     += size;
+                r->nremaining = size;
+                r->body       = size > 0 ? BODY_DATA : BODY_TRAILERS;
+            }
+        }
+    }
+
+    if (r->body == BODY_NONE) {
+        return 0;
+    }
+
+    /* Make room for more right behind the header (the rest of the buffer
+     * only holds body data not consumed yet) */
+    memmove(c->buffer + r->nparsed, c->buffer + c->noffset, c->nbuffer - c->noffset);
+    c->nbuffer -= c->noffset - r->nparsed;
+    c->noffset  = r->nparsed;
+
+    if (c->nbuffer == sizeof(c->buffer)) {
+        debug("Chunk line too large");
+        r->body = BODY_ERROR;
+        errno   = EPROTO;
+        return -1;
     }
-#endif
-    return 0;
 
-fail:
+    errno = EAGAIN;
     return -1;
 }
 
+/**
+ * Consume piece of request body.
+ *
+ * @param   r           Request structure.
+ * @param   size        Number of bytes of piece used.
+ **/
+void request_body_consume(Request *r, size_t size) {
+    r->connection->noffset += size;
+    r->nremaining -= size;
+    if (r->nremaining == 0) {
+        r->body = r->chunked ? BODY_CHUNK_END : BODY_NONE;
+    }
+}
+
+/**
+ * Discard request body that is not read.
+ *
+ * @param   r           Request structure.
+ *
+ * Only what is already buffered is discarded: if the rest of the body has not
+ * arrived yet, it cannot be skipped without waiting for all of it, so the
+ * connection must close after the response instead.
+ **/
+void request_body_discard(Request *r) {
+    const char *data;
+    ssize_t n;
+
+    while ((n = request_body_buffered(r, &data)) > 0) {
+        request_body_consume(r, n);
+    }
+    if (n < 0) {
+        r->keep_alive = false;
+    }
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
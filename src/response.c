@@ -0,0 +1,176 @@
+/* response.c: HTTP Response Builder */
+
+#include "spidey.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+#include <sys/uio.h>
+
+/**
+ * Append formatted text to response header.
+ *
+ * @param   response    Response structure.
+ * @param   format      printf format string.
+ * @param   args        Arguments for format.
+ *
+ * If the text does not fit, then the response is marked as truncated (and
+ * will not be sent).
+ **/
+static void response_vappend(Response *response, const char *format, va_list args) {
+    size_t room = sizeof(response->data) - response->length;
+
+    if (response->truncated) {
+        return;
+    }
+
+    int n = vsnprintf(response->data + response->length, room, format, args);
+    if (n < 0 || (size_t)n >= room) {
+        response->truncated = true;
+        response->data[response->length] = '\0';
+        return;
+    }
+    response->length += n;
+}
+
+/**
+ * Append formatted text to response header.
+ **/
+static void response_append(Response *response, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    response_vappend(response, format, args);
+    va_end(args);
+}
+
+/**
+ * Start response header with status line.
+ *
+ * @param   response    Response structure.
+ * @param   status      HTTP status of response.
+ **/
+void response_start(Response *response, Status status) {
+    response_start_status(response, http_status_string(status));
+}
+
+/**
+ * Start response header with status line of arbitrary status.
+ *
+ * @param   response    Response structure.
+ * @param   status      Status code and reason phrase (i.e. 404 Not Found).
+ **/
+void response_start_status(Response *response, const char *status) {
+    response->length    = 0;
+    response->truncated = false;
+    response_append(response, "HTTP/1.1 %s\r\n", status);
+}
+
+/**
+ * Append header field to response.
+ *
+ * @param   response    Response structure.
+ * @param   name        Name of field.
+ * @param   format      printf format string of field value.
+ **/
+void response_field(Response *response, const char *name, const char *format, ...) {
+    va_list args;
+
+    response_append(response, "%s: ", name);
+    va_start(args, format);
+    response_vappend(response, format, args);
+    va_end(args);
+    response_append(response, "\r\n");
+}
+
+/**
+ * End response header.
+ *
+ * @param   response    Response structure.
+ * @param   keep_alive  Whether connection persists after response.
+ * @return  -1 if the header did not fit and 0 on success.
+ *
+ * The Connection field and the blank line are appended.
+ **/
+int response_finish(Response *response, bool keep_alive) {
+    response_append(response, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+    if (response->truncated) {
+        debug("Response header does not fit in %zu bytes", sizeof(response->data));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write complete response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   iov         Array of buffers making up the response.
+ * @param   iovcnt      Number of buffers.
+ * @return  -1 on error and 0 on success.
+ *
+ * When the response stream is the client socket and no further request is
+ * buffered, anything already buffered in the stream is flushed and then the
+ * whole response goes out with a single writev.  Otherwise, the buffers are
+ * written into the stream, so responses to pipelined requests are batched
+ * until the last one is flushed (see handle_connection).
+ **/
+int response_write(Request *r, struct iovec *iov, int iovcnt) {
+    FILE *stream = r->connection->stream;
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    int sfd = fileno(stream);
+    if (sfd >= 0 && !connection_pending(r->connection)) {
+        if (fflush(stream) != 0 || socket_writev(sfd, iov, iovcnt) < 0) {
+            return -1;
+        }
+    } else {
+        for (int i = 0; i < iovcnt; i++) {
+            if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, stream) != iov[i].iov_len) {
+                return -1;
+            }
+        }
+    }
+
+    r->nsent += total;
+    return 0;
+}
+
+/**
+ * Send response header followed by body.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   response    Response structure.
+ * @param   body        Array of buffers making up the body (or the start of
+ * it, if the caller sends the rest itself).
+ * @param   nbody       Number of buffers.
+ * @return  -1 on error and 0 on success.
+ *
+ * The Connection field (which depends on the request) and the blank line are
+ * appended (see response_finish), and then the header and body go out
+ * together with response_write, so a small response is a single write (and a
+ * single segment).  Responses to HEAD requests are just the header.
+ **/
+int response_send(Request *r, Response *response, struct iovec *body, int nbody) {
+    struct iovec iov[nbody + 1];
+
+    if (response_finish(response, r->keep_alive) < 0) {
+        return -1;
+    }
+
+    if (r->head) {
+        nbody = 0;
+    }
+
+    iov[0] = (struct iovec){response->data, response->length};
+    if (nbody > 0) {
+        memcpy(iov + 1, body, nbody * sizeof(struct iovec));
+    }
+    return response_write(r, iov, nbody + 1);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
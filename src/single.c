@@ -8,27 +8,27 @@
 #include <unistd.h>
 
 /**
- * Handle one HTTP request at a time.
+ * Handle one HTTP connection at a time.
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
  **/
 int single_server(int sfd) {
     log("Entered Single Server");
-    /* Accept and handle HTTP request */
+    /* Accept and handle HTTP connection */
     while (true) {
-    	/* Accept request */
-        Request *request = accept_request(sfd);
-        if ( !request ) {
-            log("Unable to accept request: %s", strerror(errno));
+    	/* Accept connection */
+        Connection *connection = accept_connection(sfd);
+        if ( !connection ) {
+            log("Unable to accept connection: %s", strerror(errno));
             continue;
         }
 
-	/* Handle request */
-        handle_request(request);
+	/* Handle requests on connection */
+        handle_connection(connection);
 
-	/* Free request */
-        free_request(request);
+	/* Free connection */
+        free_connection(connection);
     }
 
     /* Close server socket */
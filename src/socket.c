@@ -3,13 +3,16 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /**
@@ -36,7 +39,7 @@ int socket_listen(const char *port) {
     int server_fd = -1;
     for (struct addrinfo *p = results; p && server_fd < 0; p = p->ai_next) {
         /* Allocate socket */
-        if ((server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+        if ((server_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0) {
             fprintf(stderr, "socket failed: %s\n", strerror(errno));
             continue;
         }
@@ -63,4 +66,95 @@ int socket_listen(const char *port) {
 
 }
 
+/**
+ * Put socket (or pipe) into or out of non-blocking mode.
+ *
+ * @param   fd          Socket file descriptor.
+ * @param   nonblocking Whether operations should fail instead of waiting.
+ * @return  -1 on error and 0 on success.
+ **/
+int socket_nonblocking(int fd, bool nonblocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) < 0) {
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Cork or uncork socket.
+ *
+ * @param   fd          Socket file descriptor.
+ * @param   cork        Whether to hold back partial frames.
+ * @return  -1 on error and 0 on success.
+ *
+ * While corked, the kernel only sends full frames, so a response header and
+ * the start of its body go out together.  Uncorking sends whatever is left.
+ **/
+int socket_cork(int fd, bool cork) {
+    int value = cork;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) < 0) {
+        debug("Unable to set TCP_CORK: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Apply client socket tunables.
+ *
+ * @param   fd          Client socket file descriptor.
+ *
+ * Responses are assembled before they are written (and corked around
+ * sendfile), so Nagle's algorithm only delays them: TCP_NODELAY is set
+ * unless NoDelay is turned off.  If SendBufferSize is set, then it overrides
+ * the kernel's (auto-tuned) send buffer size.
+ *
+ * Failures are only logged, since the socket works either way.
+ **/
+void socket_tune(int fd) {
+    int value = 1;
+    if (NoDelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) < 0) {
+        debug("Unable to set TCP_NODELAY: %s", strerror(errno));
+    }
+
+    if (SendBufferSize > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SendBufferSize, sizeof(SendBufferSize)) < 0) {
+        debug("Unable to set SO_SNDBUF: %s", strerror(errno));
+    }
+}
+
+/**
+ * Write all of the given buffers to socket.
+ *
+ * @param   fd          Socket file descriptor.
+ * @param   iov         Array of buffers (adjusted as data is written).
+ * @param   iovcnt      Number of buffers.
+ * @return  -1 on error and 0 on success.
+ **/
+int socket_writev(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t nwritten = writev(fd, iov, iovcnt);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            debug("Unable to writev: %s", strerror(errno));
+            return -1;
+        }
+
+        /* Skip past what was written */
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *)iov->iov_base + nwritten;
+            iov->iov_len  -= nwritten;
+        }
+    }
+    return 0;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
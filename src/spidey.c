@@ -3,16 +3,30 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 
-/* Global Variables */
+/* Global Variables
+ *
+ * These are only set while parsing options in main, before any server (and
+ * therefore any worker thread) is started, and are read-only afterwards. */
 char *Port	      = "9898";
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
+int   RootFd	      = -1;
+int   Workers	      = 0;
+int   KeepAliveTimeout = 5;
+size_t FileCacheBudget = 16 * 1024 * 1024;
+off_t CompressMinSize = 1024;
+off_t MaxBodySize     = 16 * 1024 * 1024;
+LogLevel Verbosity    = LEVEL_INFO;
+bool  NoDelay	      = true;
+int   SendBufferSize  = 0;
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +35,25 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [abBhcClmMNprstwWz]\n", progname);
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -a path       Access log file (- for stderr)\n");
+    fprintf(stderr, "    -b bytes      File cache budget (0 disables caching)\n");
+    fprintf(stderr, "    -B bytes      Largest request body (0 rejects bodies)\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -c mode       Single, Forking, Event, Prefork, or Threaded mode\n");
+    fprintf(stderr, "    -C rule       Cache-Control by mimetype (e.g. image/*=max-age=86400)\n");
+    fprintf(stderr, "    -l level      Log level (error, info, or debug)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -N            Leave Nagle's algorithm on (no TCP_NODELAY)\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -s bytes      Client socket send buffer size (0 for kernel default)\n");
+    fprintf(stderr, "    -t seconds    Keep-alive idle timeout (0 disables keep-alive)\n");
+    fprintf(stderr, "    -w workers    Number of workers (Prefork or Threaded mode, or helpers in Event mode)\n");
+    fprintf(stderr, "    -W rule       Persistent SCGI workers for scripts under URI (e.g. /scripts=4, see README)\n");
+    fprintf(stderr, "    -z bytes      Smallest file to compress (-1 disables compression)\n");
     exit(status);
 }
 
@@ -40,10 +65,12 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, MimeTypesPath, DefaultMimeType, Port, RootPath,
+ * KeepAliveTimeout, Workers, FileCacheBudget, CompressMinSize, MaxBodySize,
+ * Verbosity, NoDelay, SendBufferSize, the Cache-Control and CGI worker rules,
+ * and the access log path if specified.
  */
-bool parse_options(int argc, char *argv[], ServerMode *mode) {
+bool parse_options(int argc, char *argv[], ServerMode *mode, char **accesslog) {
     int argind = 1;
     while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
         char *arg = argv[argind++];
@@ -53,26 +80,90 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    	    *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
 	    	    *mode = FORKING;
+                } else if (streq(argv[argind], "event")) {
+                    *mode = EVENT;
+                } else if (streq(argv[argind], "prefork")) {
+                    *mode = PREFORK;
+                } else if (streq(argv[argind], "threaded")) {
+                    *mode = THREADED;
 	    	} else {
 	    	    return false;
 	    	}
 	    	argind++;
 	    	break;
+	    case 'C':
+	    	if (cache_control_add(argv[argind++]) < 0) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'a':
+	    	*accesslog = argv[argind++];
+	    	break;
+	    case 'b':
+	    	FileCacheBudget = strtoull(argv[argind++], NULL, 10);
+	    	break;
+	    case 'B':
+	    	MaxBodySize = strtoll(argv[argind++], NULL, 10);
+	    	if (MaxBodySize < 0) {
+	    	    return false;
+	    	}
+	    	break;
 	    case 'h':
 	    	usage(argv[0], EXIT_SUCCESS);
 	    	break;
+	    case 'l':
+	    	if (streq(argv[argind], "error")) {
+	    	    Verbosity = LEVEL_ERROR;
+	    	} else if (streq(argv[argind], "info")) {
+	    	    Verbosity = LEVEL_INFO;
+	    	} else if (streq(argv[argind], "debug")) {
+	    	    Verbosity = LEVEL_DEBUG;
+	    	} else {
+	    	    return false;
+	    	}
+	    	argind++;
+	    	break;
 	    case 'm':
 	    	MimeTypesPath = argv[argind++];
 	    	break;
 	    case 'M':
 	    	DefaultMimeType = argv[argind++];
 	    	break;
+	    case 'N':
+	    	NoDelay = false;
+	    	break;
 	    case 'p':
 	    	Port = argv[argind++];
 	    	break;
 	    case 'r':
 	    	RootPath = argv[argind++];
 	    	break;
+	    case 's':
+	    	SendBufferSize = atoi(argv[argind++]);
+	    	if (SendBufferSize < 0) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 't':
+	    	KeepAliveTimeout = atoi(argv[argind++]);
+	    	if (KeepAliveTimeout < 0) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'w':
+	    	Workers = atoi(argv[argind++]);
+	    	if (Workers <= 0) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'W':
+	    	if (cgipool_add(argv[argind++]) < 0) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'z':
+	    	CompressMinSize = strtoll(argv[argind++], NULL, 10);
+	    	break;
 	    default:
 	        return false;
 	    	break;
@@ -87,33 +178,77 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
  **/
 int main(int argc, char *argv[]) {
     ServerMode mode = SINGLE;
+    char *accesslog = NULL;
 
     /* Parse command line options */
-    if ( !parse_options(argc, argv, &mode) ) {
+    if ( !parse_options(argc, argv, &mode, &accesslog) ) {
         debug("Error Parsing Options");
     }
 
+    /* Writing to a closed client must not terminate the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Load mimetypes (and reload them on SIGHUP) */
+    mimetypes_load(MimeTypesPath);
+
+    struct sigaction hangup = {.sa_handler = mimetypes_hangup, .sa_flags = SA_RESTART};
+    sigaction(SIGHUP, &hangup, NULL);
+
     /* Listen to server socket */
     int server_fd = socket_listen(Port);
     if (server_fd < 0) {
         return EXIT_FAILURE;
     }
 
+    /* Determine real RootPath and open it for resolving requests */
     char buffer[BUFSIZ];
     RootPath = realpath(RootPath, buffer);
-    
-    /* Determine real RootPath */
+    if (!RootPath || (RootFd = open(RootPath, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fatal("Unable to open root directory: %s", strerror(errno));
+    }
+
+    /* Load page templates and pre-render error responses */
+    templates_load();
+
+    /* Start persistent CGI workers */
+    if (cgipool_start(server_fd) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Open access log */
+    if (accesslog && accesslog_open(accesslog) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Default to one worker per online processor */
+    if (Workers <= 0) {
+        Workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
     log("Listening on port %s", Port);
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("Workers         = %d", Workers);
+    debug("Timeout         = %d", KeepAliveTimeout);
+    debug("FileCacheBudget = %zu", FileCacheBudget);
+    debug("CompressMinSize = %jd", (intmax_t)CompressMinSize);
+    debug("MaxBodySize     = %jd", (intmax_t)MaxBodySize);
+    debug("NoDelay         = %d", NoDelay);
+    debug("SendBufferSize  = %d", SendBufferSize);
+    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" : mode == EVENT ? "Event" : mode == PREFORK ? "Prefork" : "Threaded");
 
-    /* Start either forking or single HTTP server */
+    /* Start appropriate HTTP server for mode */
     if ( mode == SINGLE ) {
         single_server(server_fd);
     } else if ( mode == FORKING ) {
         forking_server(server_fd);
+    } else if ( mode == EVENT ) {
+        event_server(server_fd);
+    } else if ( mode == PREFORK ) {
+        prefork_server(server_fd);
+    } else if ( mode == THREADED ) {
+        threaded_server(server_fd);
     } else {
         log("No server has started; error with choosing mode");
         close(server_fd);
@@ -0,0 +1,147 @@
+/* templates.c: HTML Page Templates */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/**
+ * Pre-rendered error response
+ */
+typedef struct {
+    char       *data[2];                /*< Response when closing or keeping alive */
+    size_t      size[2];                /*< Length of each response */
+    size_t      nheader[2];             /*< Length of header of each response */
+} ErrorResponse;
+
+/* Global Variables */
+
+static char          *MainPage      = NULL; /* Contents of main.html */
+static size_t         MainPageSize  = 0;    /* Length of main.html */
+static char          *ErrorPage     = NULL; /* Contents of error.html */
+static ErrorResponse *Errors        = NULL; /* Pre-rendered error responses */
+static size_t         NErrors       = 0;    /* Number of Status values */
+
+/**
+ * Read template from RootPath.
+ *
+ * @param   name        Name of template file.
+ * @param   size        Pointer to store length of template in.
+ * @return  Newly allocated contents of template (an empty string if the file
+ * cannot be read).
+ **/
+static char * templates_read(const char *name, size_t *size) {
+    char path[BUFSIZ];
+    char *data = NULL;
+    size_t ndata = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", RootPath, name);
+
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        log("Unable to open template %s: %s", path, strerror(errno));
+    } else {
+        FILE *ms = open_memstream(&data, &ndata);
+        char buffer[BUFSIZ];
+        size_t nread;
+
+        while (ms && (nread = fread(buffer, 1, BUFSIZ, fs)) > 0) {
+            fwrite(buffer, 1, nread, ms);
+        }
+        if (ms) {
+            fclose(ms);
+        }
+        fclose(fs);
+    }
+
+    if (!data) {
+        data  = strdup("");
+        ndata = 0;
+    }
+    *size = ndata;
+    return data;
+}
+
+/**
+ * Load main.html and error.html from RootPath and pre-render error responses.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * For every Status, a complete response (status line, header, and error page)
+ * is rendered for both a persistent and a closing connection, so sending an
+ * error is a single write of a static buffer.
+ *
+ * Missing templates are treated as empty pages.
+ **/
+int templates_load(void) {
+    size_t nerror;
+
+    MainPage  = templates_read("main.html", &MainPageSize);
+    ErrorPage = templates_read("error.html", &nerror);
+
+    while (http_status_string(NErrors)) {
+        NErrors++;
+    }
+
+    Errors = calloc(NErrors, sizeof(ErrorResponse));
+    if (!MainPage || !ErrorPage || !Errors) {
+        log("Unable to allocate templates: %s", strerror(errno));
+        return -1;
+    }
+
+    for (Status status = 0; status < NErrors; status++) {
+        const char *string = http_status_string(status);
+        int nbody = MainPageSize + strlen("<h1></h1>\n") + strlen(string) + nerror;
+
+        for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+            int n = asprintf(&Errors[status].data[keep_alive],
+                "HTTP/1.1 %s\r\n"
+                "Content-Type: text/html\r\n"
+                "Content-Length: %d\r\n"
+                "Connection: %s\r\n"
+                "\r\n"
+                "%s<h1>%s</h1>\n%s",
+                string, nbody, keep_alive ? "keep-alive" : "close", MainPage, string, ErrorPage);
+            if (n < 0) {
+                log("Unable to render error response: %s", strerror(errno));
+                Errors[status].data[keep_alive] = NULL;
+                return -1;
+            }
+            Errors[status].size[keep_alive]    = n;
+            Errors[status].nheader[keep_alive] = n - nbody;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Return contents of main.html.
+ *
+ * @param   size        Pointer to store length of page in.
+ * @return  Contents of page (owned by the templates and must not be free'd).
+ **/
+const char * templates_main(size_t *size) {
+    *size = MainPageSize;
+    return MainPage ? MainPage : "";
+}
+
+/**
+ * Return pre-rendered error response.
+ *
+ * @param   status      HTTP status of response.
+ * @param   keep_alive  Whether the connection persists after the response.
+ * @param   head        Whether only the header is sent (HEAD request).
+ * @param   size        Pointer to store length of response in.
+ * @return  Complete response (or NULL if none was rendered for status).
+ **/
+const char * templates_error(Status status, bool keep_alive, bool head, size_t *size) {
+    if (status >= NErrors || !Errors[status].data[keep_alive]) {
+        return NULL;
+    }
+
+    *size = head ? Errors[status].nheader[keep_alive] : Errors[status].size[keep_alive];
+    return Errors[status].data[keep_alive];
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,197 @@
+/* threaded.c: Thread Pool HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/**
+ * Per-worker double-ended queue of accepted connections
+ */
+typedef struct {
+    pthread_mutex_t lock;               /*< Protects the fields below */
+    Connection    **connections;        /*< Ring buffer of connections */
+    size_t          capacity;           /*< Allocated size of ring buffer */
+    size_t          head;               /*< Index of oldest connection */
+    size_t          size;               /*< Number of queued connections */
+} Deque;
+
+/**
+ * Thread pool worker
+ */
+typedef struct {
+    pthread_t       thread;             /*< Worker thread */
+    size_t          id;                 /*< Index of worker (and its deque) */
+} Worker;
+
+/* Global Variables */
+
+static Deque   *Deques  = NULL;         /* One deque per worker */
+static sem_t    Pending;                /* Number of queued connections */
+
+/* Deque Functions */
+
+/**
+ * Append connection to back of deque.
+ *
+ * @param   d           Deque structure.
+ * @param   c           Connection to append.
+ * @return  -1 on error and 0 on success.
+ **/
+static int deque_push(Deque *d, Connection *c) {
+    int status = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->size == d->capacity) {
+        size_t capacity          = d->capacity ? 2 * d->capacity : 16;
+        Connection **connections = calloc(capacity, sizeof(Connection *));
+        if (!connections) {
+            status = -1;
+            goto done;
+        }
+
+        for (size_t i = 0; i < d->size; i++) {
+            connections[i] = d->connections[(d->head + i) % d->capacity];
+        }
+        free(d->connections);
+        d->connections = connections;
+        d->capacity = capacity;
+        d->head     = 0;
+    }
+
+    d->connections[(d->head + d->size++) % d->capacity] = c;
+
+done:
+    pthread_mutex_unlock(&d->lock);
+    return status;
+}
+
+/**
+ * Remove connection from front of deque (used by the owning worker).
+ *
+ * @param   d           Deque structure.
+ * @return  Oldest connection (or NULL if deque is empty).
+ **/
+static Connection * deque_pop_front(Deque *d) {
+    Connection *c = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->size) {
+        c = d->connections[d->head];
+        d->head = (d->head + 1) % d->capacity;
+        d->size--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return c;
+}
+
+/**
+ * Remove connection from back of deque (used by stealing workers).
+ *
+ * @param   d           Deque structure.
+ * @return  Newest connection (or NULL if deque is empty).
+ *
+ * Thieves take the most recently queued connection, which is the one that
+ * would otherwise wait the longest behind the owner's backlog.
+ **/
+static Connection * deque_pop_back(Deque *d) {
+    Connection *c = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->size) {
+        c = d->connections[(d->head + --d->size) % d->capacity];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return c;
+}
+
+/* Worker Functions */
+
+/**
+ * Handle connections from own deque, stealing from other deques when empty.
+ *
+ * @param   arg         Worker structure.
+ * @return  NULL.
+ *
+ * Every post to the Pending semaphore corresponds to exactly one queued
+ * connection, so a worker that decrements it is guaranteed to find a
+ * connection in some deque.
+ **/
+static void * worker_thread(void *arg) {
+    Worker *w = arg;
+
+    while (true) {
+        while (sem_wait(&Pending) < 0 && errno == EINTR);
+
+        Connection *c = deque_pop_front(&Deques[w->id]);
+        for (size_t i = 1; !c; i++) {
+            c = deque_pop_back(&Deques[(w->id + i) % Workers]);
+        }
+
+        handle_connection(c);
+        free_connection(c);
+    }
+
+    return NULL;
+}
+
+/**
+ * Handle HTTP requests with a fixed pool of worker threads.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The main thread only accepts connections and distributes them round-robin
+ * to the Workers deques.  Idle workers steal queued connections from busy
+ * ones, so slow requests (i.e. CGI) do not strand the connections queued
+ * behind them.
+ **/
+int threaded_server(int sfd) {
+    log("Entered Threaded Server");
+
+    Deques          = calloc(Workers, sizeof(Deque));
+    Worker *workers = calloc(Workers, sizeof(Worker));
+    if (!Deques || !workers || sem_init(&Pending, 0, 0) < 0) {
+        log("Unable to allocate workers: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* Start workers */
+    for (int i = 0; i < Workers; i++) {
+        pthread_mutex_init(&Deques[i].lock, NULL);
+        workers[i].id = i;
+
+        int status = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+        if (status != 0) {
+            log("Unable to create worker: %s", strerror(status));
+            goto fail;
+        }
+    }
+
+    /* Accept and distribute HTTP connections */
+    for (size_t next = 0; true; next = (next + 1) % Workers) {
+        Connection *connection = accept_connection(sfd);
+        if ( !connection ) {
+            log("Unable to accept connection: %s", strerror(errno));
+            continue;
+        }
+
+        if (deque_push(&Deques[next], connection) < 0) {
+            log("Unable to queue connection: %s", strerror(errno));
+            free_connection(connection);
+            continue;
+        }
+        sem_post(&Pending);
+    }
+
+fail:
+    /* Close server socket */
+    close(sfd);
+    return EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
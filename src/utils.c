@@ -6,109 +6,58 @@
 #include <errno.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <linux/openat2.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 /**
- * Determine mime-type from file extension.
+ * Open file (or directory) corresponding to URI beneath RootFd.
  *
- * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
- *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
- *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
- * following format:
- *
- *  <MIMETYPE>      <EXT1> <EXT2> ...
+ * @param   uri         Resource path of URI.
+ * @return  Open file descriptor of the resource (or -1 on error).
  *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
+ * The URI is resolved by the kernel (openat2) relative to the RootFd
+ * directory opened at startup.  RESOLVE_BENEATH rejects any resolution that
+ * would leave the root (through "..", absolute paths, or symlinks), so
+ * traversal is impossible by construction, and RESOLVE_NO_MAGICLINKS rejects
+ * /proc style links.
  *
- * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
+ * The file is opened non-blocking so that opening a FIFO does not hang.
  *
- * This function returns an allocated string that must be free'd.
- **/
-char * determine_mimetype(const char *path) {
-    char *ext;
-    char *mimetype;
-    char *token;
-    char buffer[BUFSIZ];
-    FILE *fs = NULL;
-
-    /* Find file extension */
-
-    ext = strrchr(path, '.');
-
-    if ( !ext ) {
-        debug("The . character was not found so use default mimetype");
-        goto failure;
-    }
-    ext++;
-
-    // log("Extension is: %s", ext);
+ * The returned file descriptor must later be closed.
+ */
+int open_request_path(const char *uri) {
+    struct open_how how = {
+        .flags   = O_RDONLY | O_NONBLOCK | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
 
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath, "r");
-    if ( !(fs) ) {
-        debug("Error opening file with mimetypes: %s", strerror(errno));
-        goto failure;
+    /* Resolve relative to root */
+    while (*uri == '/') {
+        uri++;
     }
 
-    /* Scan file for matching file extensions */
-    while( fgets(buffer, BUFSIZ, fs) ) {
-        mimetype = strtok(skip_whitespace(buffer), WHITESPACE);
-        if( !mimetype ){
-            continue;
-        }
-
-        while ( (token = strtok(NULL, WHITESPACE) ) ) {
-            if ( streq(token, ext) ){
-                goto end;
-            }
-        }
+    int fd = syscall(SYS_openat2, RootFd, *uri ? uri : ".", &how, sizeof(how));
+    if (fd < 0) {
+        debug("Unable to open %s: %s", uri, strerror(errno));
     }
-
-    fclose(fs);
-
-failure:
-    return strdup(DefaultMimeType);
-
-end:
-    fclose(fs);
-    return strdup(mimetype);
+    return fd;
 }
 
 /**
- * Determine actual filesystem path based on RootPath and URI.
- *
- * @param   uri         Resource path of URI.
- * @return  An allocated string containing the full path of the resource on the
- * local filesystem.
+ * Hash string (FNV-1a).
  *
- * This function uses realpath(3) to generate the realpath of the
- * file requested in the URI.
- *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
- *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
- */
-char * determine_request_path(const char *uri) {
-
-    char path_buffer[BUFSIZ];
-    sprintf(path_buffer, "%s%s", RootPath, uri);
-
-    char *UriPath = realpath(path_buffer, NULL);
-
-    if ( strncmp(RootPath, path_buffer, strlen(RootPath)) ) {
-        return NULL;
+ * @param   s           String.
+ * @return  Hash of string.
+ **/
+size_t hash_string(const char *s) {
+    size_t hash = 2166136261u;
+    while (*s) {
+        hash = (hash ^ (unsigned char)*s++) * 16777619u;
     }
-
-    return UriPath;
+    return hash;
 }
 
 /**
@@ -126,6 +75,10 @@ const char * http_status_string(Status status) {
         "404 Not Found",
         "500 Internal Server Error",
         "418 I'm A Teapot",
+        "206 Partial Content",
+        "416 Range Not Satisfiable",
+        "304 Not Modified",
+        "413 Payload Too Large",
     };
 
     switch (status) { 
@@ -137,20 +90,42 @@ const char * http_status_string(Status status) {
             return StatusStrings[2];
         case HTTP_STATUS_INTERNAL_SERVER_ERROR:
             return StatusStrings[3];
+        case HTTP_STATUS_PARTIAL_CONTENT:
+            return StatusStrings[5];
+        case HTTP_STATUS_RANGE_NOT_SATISFIABLE:
+            return StatusStrings[6];
+        case HTTP_STATUS_NOT_MODIFIED:
+            return StatusStrings[7];
+        case HTTP_STATUS_PAYLOAD_TOO_LARGE:
+            return StatusStrings[8];
         default:
             return NULL;
 
     }
 }
 
+/**
+ * Remove trailing whitespace characters (including CRLF) from string
+ *
+ * @param   s           String.
+ * @return  Pointer to s.
+ **/
+char * rstrip(char *s) {
+    size_t n = strlen(s);
+    while ( n > 0 && isspace(s[n - 1]) ) {
+        s[--n] = '\0';
+    }
+    return s;
+}
+
 /**
  * Advance string pointer pass all nonwhitespace characters
  *
  * @param   s           String.
- * @return  Point to first whitespace character in s.
+ * @return  Point to first whitespace character (or terminating NUL) in s.
  **/
 char * skip_nonwhitespace(char *s) {
-    while ( ! isspace(*s) ) {
+    while ( *s && ! isspace(*s) ) {
         s++;
     }
 
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# Read the whole request body before writing any output
+BYTES=$(wc -c)
+
+echo "HTTP/1.0 200 OK"
+echo "Content-type: text/plain"
+echo
+
+echo $BYTES
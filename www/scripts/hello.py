@@ -1,19 +1,47 @@
 #!/usr/bin/env python3
 
 import cgi
+import io
+import os
+import socket
+import sys
 
-print('HTTP/1.0 200 OK')
-print('Content-Type: text/html')
-print()
+def hello(environ, body, out):
+    print('HTTP/1.0 200 OK', file=out)
+    print('Content-Type: text/html', file=out)
+    print(file=out)
 
-form = cgi.FieldStorage()
+    form = cgi.FieldStorage(fp=body, environ=environ)
 
-if 'user' in form:
-    print('<h1>Hello, {}</h1>'.format(form['user'].value))
+    if 'user' in form:
+        print('<h1>Hello, {}</h1>'.format(form['user'].value), file=out)
 
-print('''
+    print('''
 <form>
     <input type="text" name="user">
     <input type="submit">
 </form>
-''')
+''', file=out)
+
+def serve(listener):
+    ''' Handle SCGI requests as a persistent worker (spidey -W) '''
+    while True:
+        connection, _ = listener.accept()
+        with connection, connection.makefile('rb') as reader, connection.makefile('w') as writer:
+            length   = int(b''.join(iter(lambda: reader.read(1), b':')))
+            headers  = reader.read(length).split(b'\0')
+            reader.read(1)
+            environ  = {k.decode(): v.decode() for k, v in zip(headers[0::2], headers[1::2])}
+            body     = io.BytesIO(reader.read(int(environ.get('CONTENT_LENGTH') or 0)))
+            hello(environ, body, writer)
+
+try:
+    listener = socket.socket(fileno=os.dup(0))
+    pooled   = listener.getsockopt(socket.SOL_SOCKET, socket.SO_ACCEPTCONN)
+except OSError:
+    pooled   = False
+
+if pooled:
+    serve(listener)
+else:
+    hello(os.environ, sys.stdin.buffer, sys.stdout)